@@ -18,6 +18,45 @@ class aabb{
         , max{ point3(fmax(min.x, max.x),fmax(min.y, max.y),fmax(min.z, max.z)) } 
         {}
 
+        // box that contains nothing, the identity for surrounding_box
+        // built directly since the two point constructor reorders min and max
+        static aabb empty() {
+            aabb b;
+            b.min = point3(infinity);
+            b.max = point3(-infinity);
+            return b;
+        }
+
+        bool is_empty() const {
+            return min.x > max.x || min.y > max.y || min.z > max.z;
+        }
+
+        vec3 diagonal() const { return max - min; }
+
+        point3 centroid() const { return 0.5 * (min + max); }
+
+        Float surface_area() const {
+            if (is_empty()) return 0;
+            vec3 d = diagonal();
+            return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+        }
+
+        // index of the longest axis of the box
+        int max_extent() const {
+            vec3 d = diagonal();
+            if (d.x > d.y && d.x > d.z) return 0;
+            return d.y > d.z ? 1 : 2;
+        }
+
+        // position of p relative to the box, 0 at min and 1 at max on each axis
+        vec3 offset(const point3& p) const {
+            vec3 o = p - min;
+            if (max.x > min.x) o.x /= max.x - min.x;
+            if (max.y > min.y) o.y /= max.y - min.y;
+            if (max.z > min.z) o.z /= max.z - min.z;
+            return o;
+        }
+
         bool hit(const ray& r, Float t_min, Float t_max) const {
             Float t0 = fmin((min.x - r.orig.x) / r.dir.x, (max.x - r.orig.x) / r.dir.x);
             Float t1 = fmax((min.x - r.orig.x) / r.dir.x, (max.x - r.orig.x) / r.dir.x);
@@ -48,6 +87,9 @@ class aabb{
 };
 
 aabb surrounding_box(const aabb& b0, const aabb& b1) {
+    if (b0.is_empty()) return b1;
+    if (b1.is_empty()) return b0;
+
     point3 small(fmin(b0.min.x, b1.min.x),
                   fmin(b0.min.y, b1.min.y),
                   fmin(b0.min.z, b1.min.z));
@@ -60,6 +102,8 @@ aabb surrounding_box(const aabb& b0, const aabb& b1) {
 }
 
 aabb surrounding_box(const aabb& b0, const point3& p) {
+    if (b0.is_empty()) return aabb(p, p);
+
     point3 small(fmin(b0.min.x, p.x),
                   fmin(b0.min.y, p.y),
                   fmin(b0.min.z, p.z));
@@ -0,0 +1,140 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include <iostream>
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "bvh_node.hpp"
+#include "linear_bvh.hpp"
+#include "wide_bvh.hpp"
+#include "compressed_bvh.hpp"
+#include "motion_bvh.hpp"
+#include "bvh_report.hpp"
+#include "timing.hpp"
+
+/*
+ * Structure the render traverses
+ *   tree:   the bvh_node tree as built, recursive traversal
+ *   linear: the tree flattened into a linear_bvh, iterative traversal
+ *   bvh4:   the tree collapsed into a 4 wide BVH, SSE box tests
+ *   bvh8:   the tree collapsed into an 8 wide BVH, AVX box tests
+ *   cbvh4:  bvh4 with child boxes quantized to 8 bits per plane
+ *   cbvh8:  bvh8 with child boxes quantized to 8 bits per plane
+ *   motion: linear layout with node boxes at both shutter ends, interpolated by ray time
+ */
+enum class accel_type { tree, linear, bvh4, bvh8, cbvh4, cbvh8, motion };
+
+inline const char* accel_type_name(accel_type a) {
+    switch (a) {
+        case accel_type::tree: return "tree";
+        case accel_type::linear: return "linear";
+        case accel_type::bvh4: return "bvh4";
+        case accel_type::bvh8: return "bvh8";
+        case accel_type::cbvh4: return "cbvh4";
+        case accel_type::cbvh8: return "cbvh8";
+        case accel_type::motion: return "motion";
+    }
+    return "unknown";
+}
+
+template<int N>
+void log_wide_bvh(const wide_bvh<N>& wbvh, long long milliseconds, std::ostream& log) {
+    log << "\tCollapsed into " << wbvh.nodes.size() << " " << N << " wide nodes ("
+        << wbvh.nodes.size() * sizeof(wide_bvh_node<N>) << " bytes) in "
+        << milliseconds << " milliseconds\n";
+    log << "\t" << wbvh.leaves.size() << " leaves, " << wbvh.clusters.size() << " triangle clusters of "
+        << wbvh.cluster_width << " (" << wbvh.clusters.size() * sizeof(triangle_cluster<wide_bvh<N>::cluster_width>)
+        << " bytes), " << wbvh.primitive_ptrs.size() << " unclustered primitives\n";
+}
+
+/*
+ * Quantized node count and size, followed by what the same tree takes in
+ * every other node layout. Leaf data is shared by the wide layouts and listed once.
+ */
+template<int N>
+void log_compressed_bvh(const compressed_bvh<N>& cbvh, const bvh_node& tree, long long milliseconds, std::ostream& log) {
+    const size_t n_exact = cbvh.exact_node_count();
+    const size_t n_nodes = n_exact + cbvh.compressed_nodes.size();
+    const size_t compressed_bytes = n_exact * sizeof(wide_bvh_node<N>)
+        + cbvh.compressed_nodes.size() * sizeof(compressed_bvh_node<N>);
+
+    log << "\tCollapsed into " << n_nodes << " " << N << " wide nodes, " << cbvh.compressed_nodes.size()
+        << " quantized and " << n_exact << " kept exact (" << compressed_bytes << " bytes) in "
+        << milliseconds << " milliseconds\n";
+
+    bvh_memory m = measure_bvh(tree);
+
+    auto line = [&](const char* name, size_t nodes, size_t bytes) {
+        log << "\t\t" << name << ": " << nodes << " nodes, " << bytes << " bytes, "
+            << static_cast<Float>(bytes) / nodes << " per node, "
+            << static_cast<Float>(bytes) / compressed_bytes << "x the compressed size\n";
+    };
+
+    log << "\t[BVH Memory]\n";
+    line("bvh_node tree", m.nodes, m.bytes);
+    line("linear", m.linear_nodes, m.linear_nodes * sizeof(linear_bvh_node));
+    line(N == 8 ? "bvh8" : "bvh4", n_nodes, n_nodes * sizeof(wide_bvh_node<N>));
+    line(N == 8 ? "cbvh8" : "cbvh4", n_nodes, compressed_bytes);
+    log << "\t\tWide leaf data, the same for both wide layouts: "
+        << cbvh.leaves.size() * sizeof(wide_bvh_leaf) << " bytes of leaves, "
+        << cbvh.clusters.size() * sizeof(triangle_cluster<wide_bvh<N>::cluster_width>) << " bytes of clusters, "
+        << cbvh.primitives.size() * sizeof(shared_ptr<hittable>) + cbvh.primitive_ptrs.size() * sizeof(const hittable*)
+        << " bytes of primitive references\n";
+    log << "\t[/BVH Memory]\n";
+}
+
+/*
+ * Convert a built bvh_node tree into the structure used for rendering
+ * and log its size and the time the conversion took.
+ * bake_triangles controls whether wide BVH leaves pack triangles into SIMD clusters.
+ */
+shared_ptr<hittable> build_accelerator(const shared_ptr<bvh_node>& bvh, accel_type type,
+    Float time0, Float time1, bool bake_triangles, std::ostream& log
+) {
+    Timer t;
+    t.start();
+
+    switch (type) {
+        case accel_type::linear: {
+            auto lbvh = make_shared<linear_bvh>(*bvh, time0, time1);
+            log << "\tFlattened into " << lbvh->nodes.size() << " linear nodes ("
+                << lbvh->nodes.size() * sizeof(linear_bvh_node) << " bytes) in "
+                << t.elapsedMilli() << " milliseconds\n";
+            return lbvh;
+        }
+        case accel_type::bvh4: {
+            auto wbvh = make_shared<wide_bvh<4>>(*bvh, time0, time1, bake_triangles);
+            log_wide_bvh(*wbvh, t.elapsedMilli(), log);
+            return wbvh;
+        }
+        case accel_type::bvh8: {
+            auto wbvh = make_shared<wide_bvh<8>>(*bvh, time0, time1, bake_triangles);
+            log_wide_bvh(*wbvh, t.elapsedMilli(), log);
+            return wbvh;
+        }
+        case accel_type::cbvh4: {
+            auto cbvh = make_shared<compressed_bvh<4>>(*bvh, time0, time1, bake_triangles);
+            log_compressed_bvh(*cbvh, *bvh, t.elapsedMilli(), log);
+            return cbvh;
+        }
+        case accel_type::cbvh8: {
+            auto cbvh = make_shared<compressed_bvh<8>>(*bvh, time0, time1, bake_triangles);
+            log_compressed_bvh(*cbvh, *bvh, t.elapsedMilli(), log);
+            return cbvh;
+        }
+        case accel_type::motion: {
+            // a single time segment, build_motion_bvh can split the shutter further
+            auto mbvh = make_shared<motion_bvh>(std::vector<shared_ptr<bvh_node>>{ bvh }, time0, time1);
+            log << "\tFlattened into " << mbvh->node_count() << " motion nodes ("
+                << mbvh->node_count() * sizeof(motion_bvh_node) << " bytes) in "
+                << t.elapsedMilli() << " milliseconds\n";
+            return mbvh;
+        }
+        case accel_type::tree:
+        default:
+            return bvh;
+    }
+}
+
+#endif //ACCELERATOR_H
@@ -0,0 +1,357 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "triangle.hpp"
+#include "bvh_node.hpp"
+#include "linear_bvh.hpp"
+
+/*
+ * Read only memory map of a whole file, unmapped when the last reference goes away
+ */
+class mapped_file {
+    public:
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+
+        // returns nullptr if the file cannot be opened or mapped
+        static shared_ptr<mapped_file> open(const std::string& path);
+
+        ~mapped_file() {
+            if (data) munmap(const_cast<unsigned char*>(data), size);
+        }
+
+    private:
+        mapped_file() {}
+};
+
+shared_ptr<mapped_file> mapped_file::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return nullptr;
+
+    shared_ptr<mapped_file> f(new mapped_file());
+    f->data = static_cast<const unsigned char*>(p);
+    f->size = st.st_size;
+    return f;
+}
+
+// 64 bit FNV-1a, h continues a previous hash
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t h = 14695981039346656037ull) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+template<typename T>
+inline uint64_t fnv1a_value(const T& v, uint64_t h) {
+    return fnv1a(&v, sizeof(T), h);
+}
+
+/*
+ * Everything the cached structure depends on: the bytes of the .obj file,
+ * the layout of the scene around it and every build setting that changes the tree.
+ * The thread count is left out, builds are identical for any number of threads.
+ * Returns 0 if the file cannot be read.
+ */
+uint64_t bvh_cache_key(const std::string& obj_file, const std::string& scene_tag,
+    const bvh_build_params& params, Float time0, Float time1
+) {
+    auto f = mapped_file::open(obj_file);
+    if (!f) return 0;
+
+    uint64_t h = fnv1a(f->data, f->size);
+    h = fnv1a(scene_tag.data(), scene_tag.size(), h);
+    h = fnv1a_value(static_cast<int>(params.split_method), h);
+    h = fnv1a_value(params.max_leaf_size, h);
+    h = fnv1a_value(params.n_buckets, h);
+    h = fnv1a_value(params.traversal_cost, h);
+    h = fnv1a_value(params.intersect_cost, h);
+    h = fnv1a_value(params.spatial_split_budget, h);
+    h = fnv1a_value(params.spatial_split_alpha, h);
+    h = fnv1a_value(params.n_spatial_bins, h);
+    h = fnv1a_value(params.spatial_split_min_span, h);
+    h = fnv1a_value(time0, h);
+    h = fnv1a_value(time1, h);
+    h = fnv1a_value(sizeof(Float), h);
+    return h;
+}
+
+std::string bvh_cache_path(const std::string& dir, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+    return dir + "/" + name;
+}
+
+/*
+ * File layout, every section starts on a 64 byte boundary so the
+ * nodes can be traversed straight out of the mapping.
+ *   header
+ *   vertices      point3[n_vertices]
+ *   normals       vec3[n_normals], n_normals is 0 or n_vertices
+ *   indices       int32[3 * n_triangles]
+ *   nodes         linear_bvh_node[n_nodes]
+ *   primitives    int32[n_primitives], index into the scene's object list per leaf slot
+ */
+struct bvh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t float_size;
+    uint64_t key;
+
+    uint64_t n_objects;
+    uint64_t n_vertices, n_normals, n_triangles, n_nodes, n_primitives;
+    uint64_t vertices_offset, normals_offset, indices_offset, nodes_offset, primitives_offset;
+
+    Float box_min[3], box_max[3];
+};
+
+const char bvh_cache_magic[8] = { 'R', 'T', 'B', 'V', 'H', 'C', '\0', '\0' };
+const uint32_t bvh_cache_version = 1;
+
+inline uint64_t bvh_cache_align(uint64_t offset) {
+    return (offset + 63) & ~uint64_t(63);
+}
+
+/*
+ * A validated cache file. The mesh is copied out since TriangleMesh owns its
+ * arrays, the nodes are used in place.
+ */
+class bvh_cache {
+    public:
+        shared_ptr<mapped_file> file;
+        const bvh_cache_header* header = nullptr;
+
+        // returns false if the file is missing, truncated, corrupt or was written for another key
+        bool open(const std::string& path, uint64_t key);
+
+        shared_ptr<TriangleMesh> load_mesh(shared_ptr<material> mat) const;
+
+        // objs must be the same scene list the cache was written for
+        shared_ptr<linear_bvh> load_linear_bvh(const std::vector<shared_ptr<hittable>>& objs) const;
+
+    private:
+        template<typename T>
+        const T* section(uint64_t offset) const {
+            return reinterpret_cast<const T*>(file->data + offset);
+        }
+
+        bool valid_sections() const;
+        bool valid_mesh() const;
+        bool valid_nodes() const;
+};
+
+bool bvh_cache::open(const std::string& path, uint64_t key) {
+    file = mapped_file::open(path);
+    if (!file || file->size < sizeof(bvh_cache_header)) return false;
+
+    header = section<bvh_cache_header>(0);
+    if (std::memcmp(header->magic, bvh_cache_magic, sizeof(bvh_cache_magic)) != 0
+        || header->version != bvh_cache_version || header->float_size != sizeof(Float)
+        || header->key != key) {
+        return false;
+    }
+
+    // traversal reads the nodes unchecked, so a damaged file is rejected here once
+    // and the caller builds the tree again
+    return valid_sections() && valid_mesh() && valid_nodes();
+}
+
+/*
+ * Every section lies inside the file, aligned, in the order of the layout and
+ * ending before the next one starts. Counts come from the file and are divided
+ * instead of multiplied, so huge ones cannot wrap around.
+ */
+bool bvh_cache::valid_sections() const {
+    const bvh_cache_header& h = *header;
+    const uint64_t int_max = std::numeric_limits<int32_t>::max();
+
+    auto fits = [](uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t align, uint64_t next) {
+        return offset % align == 0 && offset <= next && count <= (next - offset) / elem_size;
+    };
+
+    return h.vertices_offset >= sizeof(bvh_cache_header)
+        && h.n_vertices <= int_max && h.n_triangles <= int_max && h.n_nodes <= int_max && h.n_primitives <= int_max
+        && h.n_nodes > 0 && (h.n_normals == 0 || h.n_normals == h.n_vertices)
+        && fits(h.vertices_offset, h.n_vertices, sizeof(point3), alignof(point3), h.normals_offset)
+        && fits(h.normals_offset, h.n_normals, sizeof(vec3), alignof(vec3), h.indices_offset)
+        && fits(h.indices_offset, 3 * h.n_triangles, sizeof(int32_t), alignof(int32_t), h.nodes_offset)
+        && fits(h.nodes_offset, h.n_nodes, sizeof(linear_bvh_node), 64, h.primitives_offset)
+        && fits(h.primitives_offset, h.n_primitives, sizeof(int32_t), alignof(int32_t), file->size);
+}
+
+// every triangle corner is one of the vertices
+bool bvh_cache::valid_mesh() const {
+    const int32_t* indices = section<int32_t>(header->indices_offset);
+    for (uint64_t i = 0; i < 3 * header->n_triangles; i++) {
+        if (indices[i] < 0 || static_cast<uint64_t>(indices[i]) >= header->n_vertices) return false;
+    }
+    return true;
+}
+
+/*
+ * Leaves only cover primitive slots of the file and interior nodes have their first
+ * child right after them and the second further on, so every node is reached once,
+ * traversal always moves forward and the tree fits the fixed traversal stacks.
+ */
+bool bvh_cache::valid_nodes() const {
+    const linear_bvh_node* nodes = section<linear_bvh_node>(header->nodes_offset);
+    const int64_t n_nodes = header->n_nodes;
+    const int64_t n_primitives = header->n_primitives;
+
+    std::vector<int> depth(n_nodes, -1);
+    depth[0] = 0;
+
+    for (int64_t i = 0; i < n_nodes; i++) {
+        const linear_bvh_node& node = nodes[i];
+        if (depth[i] < 0 || depth[i] >= bvh_stack_size) return false;
+
+        if (node.n_primitives > 0) {
+            if (node.primitives_offset < 0 || node.primitives_offset + int64_t(node.n_primitives) > n_primitives)
+                return false;
+            continue;
+        }
+
+        int64_t second = node.second_child_offset;
+        if (node.axis > 2 || i + 1 >= n_nodes || second <= i + 1 || second >= n_nodes
+                || depth[i + 1] >= 0 || depth[second] >= 0)
+            return false;
+        depth[i + 1] = depth[second] = depth[i] + 1;
+    }
+    return true;
+}
+
+shared_ptr<TriangleMesh> bvh_cache::load_mesh(shared_ptr<material> mat) const {
+    return make_shared<TriangleMesh>(
+        header->n_triangles, section<int32_t>(header->indices_offset),
+        header->n_vertices, section<point3>(header->vertices_offset),
+        header->n_normals ? section<vec3>(header->normals_offset) : nullptr, mat);
+}
+
+shared_ptr<linear_bvh> bvh_cache::load_linear_bvh(const std::vector<shared_ptr<hittable>>& objs) const {
+    if (objs.size() != header->n_objects) return nullptr;
+
+    const int32_t* indices = section<int32_t>(header->primitives_offset);
+    std::vector<shared_ptr<hittable>> primitives(header->n_primitives);
+    for (size_t i = 0; i < header->n_primitives; i++) {
+        if (indices[i] < 0 || static_cast<size_t>(indices[i]) >= objs.size()) return nullptr;
+        primitives[i] = objs[indices[i]];
+    }
+
+    aabb box(
+        point3(header->box_min[0], header->box_min[1], header->box_min[2]),
+        point3(header->box_max[0], header->box_max[1], header->box_max[2]));
+
+    return make_shared<linear_bvh>(section<linear_bvh_node>(header->nodes_offset), header->n_nodes,
+        primitives, box, file);
+}
+
+/*
+ * Write mesh, the nodes of lbvh and the position of each of its primitives in objs.
+ * Written to a temporary file of its own first and renamed, so a concurrent run never maps half
+ * a file, and runs writing the same cache at once each rename a whole file of their own.
+ */
+bool write_bvh_cache(const std::string& path, uint64_t key, const TriangleMesh& mesh,
+    const linear_bvh& lbvh, const std::vector<shared_ptr<hittable>>& objs
+) {
+    std::unordered_map<const hittable*, int32_t> object_index;
+    for (size_t i = 0; i < objs.size(); i++) object_index[objs[i].get()] = i;
+
+    std::vector<int32_t> primitives(lbvh.primitives.size());
+    for (size_t i = 0; i < lbvh.primitives.size(); i++) {
+        auto it = object_index.find(lbvh.primitives[i].get());
+        if (it == object_index.end()) return false;
+        primitives[i] = it->second;
+    }
+
+    bvh_cache_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, bvh_cache_magic, sizeof(bvh_cache_magic));
+    h.version = bvh_cache_version;
+    h.float_size = sizeof(Float);
+    h.key = key;
+    h.n_objects = objs.size();
+    h.n_vertices = mesh.nVertices;
+    h.n_normals = mesh.n ? mesh.nVertices : 0;
+    h.n_triangles = mesh.nTriangles;
+    h.n_nodes = lbvh.node_count();
+    h.n_primitives = primitives.size();
+
+    h.vertices_offset = bvh_cache_align(sizeof(h));
+    h.normals_offset = bvh_cache_align(h.vertices_offset + h.n_vertices * sizeof(point3));
+    h.indices_offset = bvh_cache_align(h.normals_offset + h.n_normals * sizeof(vec3));
+    h.nodes_offset = bvh_cache_align(h.indices_offset + 3 * h.n_triangles * sizeof(int32_t));
+    h.primitives_offset = bvh_cache_align(h.nodes_offset + h.n_nodes * sizeof(linear_bvh_node));
+
+    for (int a = 0; a < 3; a++) {
+        h.box_min[a] = lbvh.box.min[a];
+        h.box_max[a] = lbvh.box.max[a];
+    }
+
+    std::string tmp_path = path + ".XXXXXX";
+    int tmp_fd = mkstemp(tmp_path.data());
+    if (tmp_fd < 0) return false;
+    // mkstemp makes the file private, the cache is read like any other file
+    fchmod(tmp_fd, 0644);
+    close(tmp_fd);
+
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+
+    auto write_at = [&](uint64_t offset, const void* data, size_t size) {
+        // pad up to the section start
+        static const char zeros[64] = {};
+        while (static_cast<uint64_t>(out.tellp()) < offset)
+            out.write(zeros, std::min<uint64_t>(64, offset - out.tellp()));
+        out.write(static_cast<const char*>(data), size);
+    };
+
+    std::vector<int32_t> indices(mesh.vertex_indicies.begin(), mesh.vertex_indicies.end());
+
+    write_at(0, &h, sizeof(h));
+    write_at(h.vertices_offset, mesh.p.get(), h.n_vertices * sizeof(point3));
+    if (h.n_normals) write_at(h.normals_offset, mesh.n.get(), h.n_normals * sizeof(vec3));
+    write_at(h.indices_offset, indices.data(), indices.size() * sizeof(int32_t));
+    write_at(h.nodes_offset, lbvh.node_data(), h.n_nodes * sizeof(linear_bvh_node));
+    write_at(h.primitives_offset, primitives.data(), primitives.size() * sizeof(int32_t));
+
+    out.close();
+    if (!out) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+#endif //BVH_CACHE_H
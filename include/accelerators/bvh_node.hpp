@@ -1,110 +1,880 @@
 #ifndef BVH_NODE_H
 #define BVH_NODE_H
 
-#include <vector> 
+#include <vector>
 #include <algorithm>
 #include <iostream>
+#include <cstdint>
+#include <limits>
 
 #include "utility.hpp"
 #include "hittable.hpp"
 #include "hittable_list.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
+#include "stats.hpp"
+#include "spatial_split.hpp"
+
+/*
+ * How the builder partitions primitives at each node
+ *   median: sort on box min along round robin axes and split the span in half
+ *   sah:    binned surface area heuristic along the axis of largest centroid extent
+ *   sbvh:   binned SAH on every axis plus spatial splits, which clip the triangles
+ *           straddling a plane into a reference on each side
+ */
+enum class bvh_split_method { median, sah, sbvh };
+
+// largest max_leaf_size, leaf primitive counts are 16 bit in linear_bvh, motion_bvh and wide_bvh
+const int bvh_max_leaf_size = std::numeric_limits<uint16_t>::max();
+
+struct bvh_build_params {
+    bvh_split_method split_method = bvh_split_method::median;
+
+    // the SAH builder makes a leaf once a node has this many primitives or fewer
+    // and splitting is not cheaper, above it a split is always made
+    int max_leaf_size = 4;
+
+    // number of centroid bins evaluated per SAH split
+    int n_buckets = 12;
+
+    // cost model, relative cost of one box test vs one primitive test
+    Float traversal_cost = 0.125;
+    Float intersect_cost = 1.0;
+
+    // sbvh: extra references spatial splits may add, as a fraction of the primitive count
+    Float spatial_split_budget = 1.0;
+
+    // sbvh: spatial splits are only tried where the children of the best object split
+    // overlap by more than this fraction of the node's surface area
+    Float spatial_split_alpha = 1e-5;
+
+    // sbvh: nodes with fewer references only use object splits, below this clipping
+    // costs more build time than the few references it separates save
+    int spatial_split_min_span = 128;
+
+    // sbvh: number of bins evaluated per axis for a spatial split
+    int n_spatial_bins = 32;
+
+    // threads used for construction, 0 uses every hardware thread
+    int n_threads = 0;
+
+    // subtrees with fewer primitives than this are built on the calling thread
+    int parallel_min_span = 4096;
+
+    // nodes with at least this many primitives compute bounds and bins in parallel
+    int parallel_bin_span = 65536;
+};
+
+inline const char* split_method_name(bvh_split_method m) {
+    switch (m) {
+        case bvh_split_method::sah: return "sah";
+        case bvh_split_method::sbvh: return "sbvh";
+        case bvh_split_method::median:
+        default: return "median";
+    }
+}
+
+// per primitive data computed once before building so the
+// recursion can reorder it in place instead of copying object lists
+// the spatial split builder uses the same struct for references, box is then clipped to
+// the part of the primitive inside the node and index may repeat across leaves
+struct bvh_primitive_info {
+    size_t index;
+    aabb box;
+    point3 centroid;
+};
+
+// levels the fixed traversal stacks of linear_bvh, motion_bvh and wide_bvh hold,
+// no tree may be deeper
+const int bvh_stack_size = 64;
+
+// past this depth the SAH and spatial split builders only split at the median count,
+// which halves the references every level, so even a degenerate run of uneven splits
+// stays below bvh_stack_size levels with up to 2^31 references and leaves never hold
+// more than max_leaf_size. Median trees halve from the root and never get deeper than 31 levels
+const int sah_max_depth = 32;
 
 class bvh_node : public hittable {
     public:
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
+
+        // primitives stored directly in a leaf made by the SAH builder
+        // empty for interior nodes and for nodes made by the median builder
+        std::vector<shared_ptr<hittable>> objects;
+
         aabb box;
 
+        // axis the primitives were partitioned along, used to order child visits
+        int split_axis = 0;
+
+        // primitives in the subtree under this node, a primitive split
+        // by the spatial split builder counts once per leaf it is in
+        int n_primitives = 0;
+
         bvh_node();
-        bvh_node(const hittable_list& list, Float time0, Float time1)
-        : bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
+        bvh_node(const hittable_list& list, Float time0, Float time1,
+            const bvh_build_params& params = bvh_build_params())
+        : bvh_node(list.objects, time0, time1, params) {}
+
+        bvh_node(const std::vector<shared_ptr<hittable>>& objs, Float time0, Float time1,
+            const bvh_build_params& params = bvh_build_params());
 
         bvh_node(
-            const std::vector<shared_ptr<hittable>>& objs,
-            int start, int end, Float time0, Float time1, int axis = 0
+            const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+            int start, int end, const bvh_build_params& params, int axis = 0, int depth = 0
         );
 
         virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
         virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override;
+
+        bool is_leaf() const { return !objects.empty(); }
+
+        // expected cost of a ray through the tree under the cost model in params,
+        // relative to the surface area of this node
+        Float sah_cost(const bvh_build_params& params) const;
+
+        // recompute every box bottom up after the primitives moved, the topology is kept
+        aabb refit(Float time0, Float time1);
+
+    private:
+        void build_median(
+            const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+            int start, int end, const bvh_build_params& params, int axis, int depth);
+
+        void build_sah(
+            const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+            int start, int end, const bvh_build_params& params, int depth);
+
+        void build_sbvh(
+            const std::vector<shared_ptr<hittable>>& objs, const std::vector<const triangle*>& tris,
+            std::vector<bvh_primitive_info>& refs, const bvh_build_params& params, Float budget, int depth);
+
+        void start_sbvh(
+            const std::vector<shared_ptr<hittable>>& objs, const std::vector<bvh_primitive_info>& info,
+            int start, int end, const bvh_build_params& params);
+
+        void build_children(
+            const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+            int start, int mid, int end, const bvh_build_params& params, int child_axis, int depth);
+
+        void make_leaf(
+            const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+            int start, int end);
+
+        Float unnormalized_sah_cost(const bvh_build_params& params) const;
 };
 
+bvh_node::bvh_node() : box{ aabb::empty() } {}
+
 bool bvh_node::bounding_box(Float, Float, aabb& output_box) const {
     output_box = box;
     return true;
 }
 
 bool bvh_node::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    thread_ray_stats.nodes_visited++;
+
     if(!box.hit(r, t_min, t_max))
         return false;
 
+    if (is_leaf()) {
+        bool hit_anything = false;
+        for (const auto& object : objects) {
+            if (object->hit(r, t_min, t_max, rec)) {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
     bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    // a span of 1 stores the same primitive as both children
+    bool hit_right = right != left && right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
 
     return hit_left || hit_right;
 }
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb ba, bb;
+bool bvh_node::occluded(const ray& r, Float t_min, Float t_max) const {
+    thread_ray_stats.nodes_visited++;
 
-    if (!a->bounding_box(0,0, ba) || !b->bounding_box(0,0, bb))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    if(!box.hit(r, t_min, t_max))
+        return false;
 
-    if (axis == 0) {
-        return ba.min.x < bb.min.x;
-    } else if (axis == 1) {
-        return ba.min.y < bb.min.y;
-    } else {
-        return ba.min.z < bb.min.z;
+    if (is_leaf()) {
+        for (const auto& object : objects) {
+            if (object->occluded(r, t_min, t_max))
+                return true;
+        }
+        return false;
     }
-}
 
-bool box_compare_x (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
+    return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
 }
 
-bool box_compare_y (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
+std::vector<bvh_primitive_info> compute_primitive_info(
+    const std::vector<shared_ptr<hittable>>& objs, Float time0, Float time1, int n_threads
+) {
+    std::vector<bvh_primitive_info> info(objs.size());
+
+    parallel_for_chunks(0, objs.size(), resolve_thread_count(n_threads), [&](int, int b, int e) {
+        for (int i = b; i < e; i++) {
+            info[i].index = i;
+            if (!objs[i]->bounding_box(time0, time1, info[i].box))
+                std::cerr << "No bounding box in bvh_node constructor.\n";
+            info[i].centroid = info[i].box.centroid();
+        }
+    });
+
+    return info;
 }
 
-bool box_compare_z (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& objs, Float time0, Float time1,
+    const bvh_build_params& params
+) {
+    if (objs.empty()) {
+        std::cerr << "No objects in bvh_node constructor.\n";
+        left = right = make_shared<hittable_list>();
+        box = aabb::empty();
+        return;
+    }
+
+    bvh_build_params p = params;
+    p.n_threads = resolve_thread_count(params.n_threads);
+
+    std::vector<bvh_primitive_info> info = compute_primitive_info(objs, time0, time1, p.n_threads);
+
+    if (p.split_method == bvh_split_method::sah)
+        build_sah(objs, info, 0, objs.size(), p, 0);
+    else if (p.split_method == bvh_split_method::sbvh)
+        start_sbvh(objs, info, 0, objs.size(), p);
+    else
+        build_median(objs, info, 0, objs.size(), p, 0, 0);
 }
 
 bvh_node::bvh_node(
-    const std::vector<shared_ptr<hittable>>& objs,
-    int start, int end, Float time0, Float time1, int axis
+    const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+    int start, int end, const bvh_build_params& params, int axis, int depth
+) {
+    if (params.split_method == bvh_split_method::sah)
+        build_sah(objs, info, start, end, params, depth);
+    else if (params.split_method == bvh_split_method::sbvh)
+        start_sbvh(objs, info, start, end, params);
+    else
+        build_median(objs, info, start, end, params, axis, depth);
+}
+
+/*
+ * Children cover disjoint ranges of info, so large subtrees are built as
+ * separate tasks. Task creation stops a couple of levels past one task per
+ * thread, which leaves enough slack to balance uneven splits.
+ */
+void bvh_node::build_children(
+    const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+    int start, int mid, int end, const bvh_build_params& params, int child_axis, int depth
 ) {
-    auto objects = objs;
+    int task_depth = 0;
+    while ((1 << task_depth) < params.n_threads) task_depth++;
+    task_depth += 2;
 
-    auto comparator = axis == 0 ? box_compare_x 
-                    : axis == 1 ? box_compare_y 
-                                : box_compare_z;
+    bool spawn = params.n_threads > 1 && depth < task_depth
+        && mid - start >= params.parallel_min_span && end - mid >= params.parallel_min_span;
 
+    if (spawn) {
+        auto left_future = std::async(std::launch::async, [&]() {
+            return make_shared<bvh_node>(objs, info, start, mid, params, child_axis, depth + 1);
+        });
+        right = make_shared<bvh_node>(objs, info, mid, end, params, child_axis, depth + 1);
+        left = left_future.get();
+    } else {
+        left = make_shared<bvh_node>(objs, info, start, mid, params, child_axis, depth + 1);
+        right = make_shared<bvh_node>(objs, info, mid, end, params, child_axis, depth + 1);
+    }
+}
+
+void bvh_node::build_median(
+    const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+    int start, int end, const bvh_build_params& params, int axis, int depth
+) {
     int span = end - start;
+    split_axis = axis;
+    n_primitives = span;
 
     if (span == 1) {
-        left = right = objects[start];
+        left = right = objs[info[start].index];
+        box = info[start].box;
+        return;
     } else if (span == 2) {
         // order doesn't matter
-        left = objects[start];
-        right = objects[start + 1];
+        left = objs[info[start].index];
+        right = objs[info[start + 1].index];
+        box = surrounding_box(info[start].box, info[start + 1].box);
+        return;
+    }
+
+    // only the partition around mid matters, not the full order
+    int mid = start + span / 2;
+    std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+        [axis](const bvh_primitive_info& a, const bvh_primitive_info& b) {
+            return a.box.min[axis] < b.box.min[axis];
+        });
+
+    build_children(objs, info, start, mid, end, params, (axis + 1) % 3, depth);
+
+    aabb box_l, box_r;
+    left->bounding_box(0, 0, box_l);
+    right->bounding_box(0, 0, box_r);
+    box = surrounding_box(box_l, box_r);
+}
+
+void bvh_node::make_leaf(
+    const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+    int start, int end
+) {
+    box = aabb::empty();
+    objects.reserve(end - start);
+    for (int i = start; i < end; i++) {
+        objects.push_back(objs[info[i].index]);
+        box = surrounding_box(box, info[i].box);
+    }
+}
+
+void bvh_node::build_sah(
+    const std::vector<shared_ptr<hittable>>& objs, std::vector<bvh_primitive_info>& info,
+    int start, int end, const bvh_build_params& params, int depth
+) {
+    int span = end - start;
+    n_primitives = span;
+
+    // near the root there are fewer tasks than threads, split the linear passes instead
+    int n_chunks = 1;
+    if (span >= params.parallel_bin_span)
+        n_chunks = std::max(1, params.n_threads >> depth);
+
+    std::vector<aabb> chunk_bounds(n_chunks, aabb::empty());
+    std::vector<aabb> chunk_centroid_bounds(n_chunks, aabb::empty());
+    n_chunks = parallel_for_chunks(start, end, n_chunks, [&](int c, int b, int e) {
+        for (int i = b; i < e; i++) {
+            chunk_bounds[c] = surrounding_box(chunk_bounds[c], info[i].box);
+            chunk_centroid_bounds[c] = surrounding_box(chunk_centroid_bounds[c], info[i].centroid);
+        }
+    });
+
+    aabb bounds = aabb::empty();
+    aabb centroid_bounds = aabb::empty();
+    for (int c = 0; c < n_chunks; c++) {
+        bounds = surrounding_box(bounds, chunk_bounds[c]);
+        centroid_bounds = surrounding_box(centroid_bounds, chunk_centroid_bounds[c]);
+    }
+
+    if (span == 1) {
+        make_leaf(objs, info, start, end);
+        return;
+    }
+
+    int dim = centroid_bounds.max_extent();
+    int mid = start + span / 2;
+    split_axis = dim;
+
+    if (depth >= sah_max_depth) {
+        if (span <= params.max_leaf_size) {
+            make_leaf(objs, info, start, end);
+            return;
+        }
+        mid = start;
+    } else if (centroid_bounds.max[dim] == centroid_bounds.min[dim]) {
+        // all centroids coincide, binning cannot separate them
+        if (span <= params.max_leaf_size) {
+            make_leaf(objs, info, start, end);
+            return;
+        }
+    } else {
+        struct bucket {
+            int count = 0;
+            aabb box = aabb::empty();
+        };
+
+        const int n_buckets = params.n_buckets;
+        std::vector<bucket> buckets(n_buckets);
+
+        auto bucket_of = [&](const bvh_primitive_info& p) {
+            int b = static_cast<int>(n_buckets * centroid_bounds.offset(p.centroid)[dim]);
+            return b >= n_buckets ? n_buckets - 1 : b;
+        };
+
+        std::vector<std::vector<bucket>> chunk_buckets(n_chunks, std::vector<bucket>(n_buckets));
+        parallel_for_chunks(start, end, n_chunks, [&](int c, int b, int e) {
+            for (int i = b; i < e; i++) {
+                bucket& bk = chunk_buckets[c][bucket_of(info[i])];
+                bk.count++;
+                bk.box = surrounding_box(bk.box, info[i].box);
+            }
+        });
+
+        for (int c = 0; c < n_chunks; c++) {
+            for (int i = 0; i < n_buckets; i++) {
+                buckets[i].count += chunk_buckets[c][i].count;
+                buckets[i].box = surrounding_box(buckets[i].box, chunk_buckets[c][i].box);
+            }
+        }
+
+        // sweep from the right to get the cost of everything above each split
+        std::vector<Float> area_above(n_buckets - 1);
+        std::vector<int> count_above(n_buckets - 1);
+        aabb acc = aabb::empty();
+        int acc_count = 0;
+        for (int i = n_buckets - 1; i > 0; i--) {
+            acc = surrounding_box(acc, buckets[i].box);
+            acc_count += buckets[i].count;
+            area_above[i - 1] = acc.surface_area();
+            count_above[i - 1] = acc_count;
+        }
+
+        // sweep from the left and evaluate the cost of splitting after bucket i
+        int min_bucket = -1;
+        Float min_cost = infinity;
+        Float inv_area = 1 / bounds.surface_area();
+        acc = aabb::empty();
+        acc_count = 0;
+        for (int i = 0; i < n_buckets - 1; i++) {
+            acc = surrounding_box(acc, buckets[i].box);
+            acc_count += buckets[i].count;
+
+            if (acc_count == 0 || count_above[i] == 0) continue;
+
+            Float cost = params.traversal_cost + params.intersect_cost * inv_area *
+                (acc_count * acc.surface_area() + count_above[i] * area_above[i]);
+
+            if (cost < min_cost) {
+                min_cost = cost;
+                min_bucket = i;
+            }
+        }
+
+        Float leaf_cost = params.intersect_cost * span;
+        if (span <= params.max_leaf_size && (min_bucket < 0 || leaf_cost <= min_cost)) {
+            make_leaf(objs, info, start, end);
+            return;
+        }
+
+        if (min_bucket >= 0) {
+            auto pmid = std::partition(info.begin() + start, info.begin() + end,
+                [&](const bvh_primitive_info& p) { return bucket_of(p) <= min_bucket; });
+            mid = static_cast<int>(pmid - info.begin());
+        }
+    }
+
+    // fall back to an equal count split if binning could not separate the primitives,
+    // or the tree is too deep to keep binning
+    if (mid == start || mid == end) {
+        mid = start + span / 2;
+        std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+            [dim](const bvh_primitive_info& a, const bvh_primitive_info& b) {
+                return a.centroid[dim] < b.centroid[dim];
+            });
+    }
+
+    build_children(objs, info, start, mid, end, params, 0, depth);
+    box = bounds;
+}
+
+void bvh_node::start_sbvh(
+    const std::vector<shared_ptr<hittable>>& objs, const std::vector<bvh_primitive_info>& info,
+    int start, int end, const bvh_build_params& params
+) {
+    std::vector<bvh_primitive_info> refs(info.begin() + start, info.begin() + end);
+
+    // looked up once, clipping needs the vertices of every triangle many times
+    std::vector<const triangle*> tris(objs.size());
+    for (size_t i = 0; i < objs.size(); i++) tris[i] = dynamic_cast<const triangle*>(objs[i].get());
+
+    build_sbvh(objs, tris, refs, params, params.spatial_split_budget * refs.size(), 0);
+}
+
+/*
+ * Spatial split BVH (Stich et al. 2009). Each node takes the cheapest of a leaf,
+ * a binned object split and a spatial split under the SAH. A spatial split cuts
+ * the node at a plane, and a reference straddling it is either clipped into one
+ * reference per side or kept whole on one side when that is cheaper (unsplitting).
+ * Spatial splits are only considered where the best object split leaves children
+ * that overlap. budget is the number of extra references the subtree may create,
+ * what a node leaves unused is handed to its children in proportion to their size,
+ * so a split near the root cannot spend the budget of the whole tree.
+ * refs is consumed.
+ */
+void bvh_node::build_sbvh(
+    const std::vector<shared_ptr<hittable>>& objs, const std::vector<const triangle*>& tris,
+    std::vector<bvh_primitive_info>& refs, const bvh_build_params& params, Float budget, int depth
+) {
+    const int n = refs.size();
+    n_primitives = n;
+
+    aabb bounds = aabb::empty();
+    aabb centroid_bounds = aabb::empty();
+    for (const auto& r : refs) {
+        bounds = surrounding_box(bounds, r.box);
+        centroid_bounds = surrounding_box(centroid_bounds, r.centroid);
+    }
+
+    if (n == 1) {
+        make_leaf(objs, refs, 0, n);
+        return;
+    }
+
+    // too deep to keep binning, the equal count split below takes over
+    const bool binning = depth < sah_max_depth;
+
+    const Float area = bounds.surface_area();
+    const Float inv_area = area > 0 ? 1 / area : 0;
+
+    struct split_choice {
+        Float cost = infinity;
+        int axis = -1;
+        int bin = -1;
+        bool spatial = false;
+        int n_left = 0, n_right = 0;
+        aabb left_box, right_box;
+    };
+    split_choice best;
+
+    struct bucket {
+        int count = 0;
+        aabb box = aabb::empty();
+    };
+
+    const int n_buckets = params.n_buckets;
+    auto bucket_of = [&](const bvh_primitive_info& p, int axis) {
+        int b = static_cast<int>(n_buckets * centroid_bounds.offset(p.centroid)[axis]);
+        return b >= n_buckets ? n_buckets - 1 : b;
+    };
+
+    // object splits on every axis
+    for (int axis = 0; axis < 3; axis++) {
+        if (!binning || centroid_bounds.max[axis] == centroid_bounds.min[axis]) continue;
+
+        std::vector<bucket> buckets(n_buckets);
+        for (const auto& r : refs) {
+            bucket& bk = buckets[bucket_of(r, axis)];
+            bk.count++;
+            bk.box = surrounding_box(bk.box, r.box);
+        }
+
+        std::vector<aabb> box_above(n_buckets - 1);
+        std::vector<int> count_above(n_buckets - 1);
+        aabb acc = aabb::empty();
+        int acc_count = 0;
+        for (int i = n_buckets - 1; i > 0; i--) {
+            acc = surrounding_box(acc, buckets[i].box);
+            acc_count += buckets[i].count;
+            box_above[i - 1] = acc;
+            count_above[i - 1] = acc_count;
+        }
+
+        acc = aabb::empty();
+        acc_count = 0;
+        for (int i = 0; i < n_buckets - 1; i++) {
+            acc = surrounding_box(acc, buckets[i].box);
+            acc_count += buckets[i].count;
+            if (acc_count == 0 || count_above[i] == 0) continue;
+
+            Float cost = params.traversal_cost + params.intersect_cost * inv_area *
+                (acc_count * acc.surface_area() + count_above[i] * box_above[i].surface_area());
+
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = i;
+                best.n_left = acc_count;
+                best.n_right = count_above[i];
+                best.left_box = acc;
+                best.right_box = box_above[i];
+            }
+        }
+    }
+
+    // spatial splits, only where the object split children overlap noticeably
+    Float overlap = best.axis < 0 ? infinity
+        : intersect_boxes(best.left_box, best.right_box).surface_area();
+    const int n_bins = params.n_spatial_bins;
+
+    // the spatial bin of coordinate x on axis and the plane below bin b, the partition
+    // decides which side a reference goes to with the same bins, so a reference ending
+    // exactly on the split plane straddles it in both
+    auto bin_of = [&](int axis, Float x) {
+        int b = static_cast<int>(n_bins * (x - bounds.min[axis]) / (bounds.max[axis] - bounds.min[axis]));
+        return b < 0 ? 0 : (b >= n_bins ? n_bins - 1 : b);
+    };
+    auto plane = [&](int axis, int b) {
+        return bounds.min[axis] + (bounds.max[axis] - bounds.min[axis]) * b / n_bins;
+    };
+
+    if (binning && n >= params.spatial_split_min_span && overlap > params.spatial_split_alpha * area && budget >= 1) {
+        struct spatial_bin {
+            int entries = 0;
+            int exits = 0;
+            aabb box = aabb::empty();
+        };
+
+        for (int axis = 0; axis < 3; axis++) {
+            if (bounds.max[axis] <= bounds.min[axis]) continue;
+
+            // chop every reference into the bins it covers
+            std::vector<spatial_bin> bins(n_bins);
+            for (const auto& r : refs) {
+                int first = bin_of(axis, r.box.min[axis]);
+                int last = bin_of(axis, r.box.max[axis]);
+
+                aabb rest = r.box;
+                for (int b = first; b < last; b++) {
+                    aabb piece, right;
+                    split_primitive_box(tris[r.index], rest, axis, plane(axis, b + 1), piece, right);
+                    bins[b].box = surrounding_box(bins[b].box, piece);
+                    rest = right;
+                }
+                bins[last].box = surrounding_box(bins[last].box, rest);
+                bins[first].entries++;
+                bins[last].exits++;
+            }
+
+            std::vector<aabb> box_above(n_bins - 1);
+            std::vector<int> count_above(n_bins - 1);
+            aabb acc = aabb::empty();
+            int acc_count = 0;
+            for (int i = n_bins - 1; i > 0; i--) {
+                acc = surrounding_box(acc, bins[i].box);
+                acc_count += bins[i].exits;
+                box_above[i - 1] = acc;
+                count_above[i - 1] = acc_count;
+            }
+
+            acc = aabb::empty();
+            acc_count = 0;
+            for (int i = 0; i < n_bins - 1; i++) {
+                acc = surrounding_box(acc, bins[i].box);
+                acc_count += bins[i].entries;
+                if (acc_count == 0 || count_above[i] == 0) continue;
+                if (acc_count + count_above[i] - n > budget) continue;
+
+                Float cost = params.traversal_cost + params.intersect_cost * inv_area *
+                    (acc_count * acc.surface_area() + count_above[i] * box_above[i].surface_area());
+
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = i;
+                    best.spatial = true;
+                    best.n_left = acc_count;
+                    best.n_right = count_above[i];
+                    best.left_box = acc;
+                    best.right_box = box_above[i];
+                }
+            }
+        }
+    }
+
+    Float leaf_cost = params.intersect_cost * n;
+    if (n <= params.max_leaf_size && (best.axis < 0 || leaf_cost <= best.cost)) {
+        make_leaf(objs, refs, 0, n);
+        return;
+    }
+
+    std::vector<bvh_primitive_info> left_refs, right_refs;
+    left_refs.reserve(best.n_left);
+    right_refs.reserve(best.n_right);
+
+    if (best.axis >= 0 && !best.spatial) {
+        for (const auto& r : refs)
+            (bucket_of(r, best.axis) <= best.bin ? left_refs : right_refs).push_back(r);
+    } else if (best.axis >= 0) {
+        const int axis = best.axis;
+        const Float pos = plane(axis, best.bin + 1);
+
+        const Float area_l = best.left_box.surface_area(), area_r = best.right_box.surface_area();
+        const Float split_cost = area_l * best.n_left + area_r * best.n_right;
+        int duplicates = 0;
+
+        for (const auto& r : refs) {
+            if (bin_of(axis, r.box.max[axis]) <= best.bin) {
+                left_refs.push_back(r);
+                continue;
+            }
+            if (bin_of(axis, r.box.min[axis]) > best.bin) {
+                right_refs.push_back(r);
+                continue;
+            }
+
+            // cost of keeping the whole reference on one side instead of clipping it
+            Float left_cost = surrounding_box(best.left_box, r.box).surface_area() * best.n_left
+                + area_r * (best.n_right - 1);
+            Float right_cost = area_l * (best.n_left - 1)
+                + surrounding_box(best.right_box, r.box).surface_area() * best.n_right;
+
+            bool unsplit = std::min(left_cost, right_cost) < split_cost || duplicates + 1 > budget;
+            if (!unsplit) duplicates++;
+
+            if (unsplit) {
+                (left_cost <= right_cost ? left_refs : right_refs).push_back(r);
+                continue;
+            }
+
+            bvh_primitive_info l = r, rr = r;
+            split_primitive_box(tris[r.index], r.box, axis, pos, l.box, rr.box);
+            if (!l.box.is_empty()) {
+                l.centroid = l.box.centroid();
+                left_refs.push_back(l);
+            }
+            if (!rr.box.is_empty()) {
+                rr.centroid = rr.box.centroid();
+                right_refs.push_back(rr);
+            }
+        }
+    }
+
+    // no usable split or too deep, fall back to an equal count split along the widest axis
+    if (left_refs.empty() || right_refs.empty()) {
+        int dim = bounds.max_extent();
+        int mid = n / 2;
+        std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+            [dim](const bvh_primitive_info& a, const bvh_primitive_info& b) {
+                return a.centroid[dim] < b.centroid[dim];
+            });
+        left_refs.assign(refs.begin(), refs.begin() + mid);
+        right_refs.assign(refs.begin() + mid, refs.end());
+        best.axis = dim;
+    }
+
+    split_axis = best.axis;
+
+    const Float n_children_refs = left_refs.size() + right_refs.size();
+    const Float budget_left = std::max<Float>(0, budget - (n_children_refs - n));
+
+    // the parent's references are no longer needed while the subtrees are built
+    std::vector<bvh_primitive_info>().swap(refs);
+
+    int task_depth = 0;
+    while ((1 << task_depth) < params.n_threads) task_depth++;
+    task_depth += 2;
+
+    bool spawn = params.n_threads > 1 && depth < task_depth
+        && static_cast<int>(left_refs.size()) >= params.parallel_min_span
+        && static_cast<int>(right_refs.size()) >= params.parallel_min_span;
+
+    auto build_child = [&](std::vector<bvh_primitive_info>& child_refs) {
+        auto child = make_shared<bvh_node>();
+        Float child_budget = budget_left * child_refs.size() / n_children_refs;
+        child->build_sbvh(objs, tris, child_refs, params, child_budget, depth + 1);
+        return child;
+    };
+
+    shared_ptr<bvh_node> l, r;
+    if (spawn) {
+        auto left_future = std::async(std::launch::async, [&]() { return build_child(left_refs); });
+        r = build_child(right_refs);
+        l = left_future.get();
     } else {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
+        l = build_child(left_refs);
+        r = build_child(right_refs);
+    }
+
+    left = l;
+    right = r;
+    box = surrounding_box(l->box, r->box);
+    n_primitives = l->n_primitives + r->n_primitives;
+}
+
+/*
+ * Every node visited costs a box test, every primitive test costs intersect_cost.
+ * A ray reaches a node with probability proportional to the node's surface area.
+ * Median leaves are nodes whose children are primitives, a span of 1 holds
+ * the same primitive twice but it is only tested once.
+ */
+Float bvh_node::unnormalized_sah_cost(const bvh_build_params& params) const {
+    Float area = box.surface_area();
+    Float cost = params.traversal_cost * area;
 
-        int mid = start + span / 2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1, (axis + 1) % 3);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1, (axis + 1) % 3);
+    if (is_leaf())
+        return cost + params.intersect_cost * objects.size() * area;
+
+    for (const auto& child : { left, right }) {
+        auto node = std::dynamic_pointer_cast<bvh_node>(child);
+        if (node)
+            cost += node->unnormalized_sah_cost(params);
+        else
+            cost += params.intersect_cost * area;
+
+        if (left == right) break;
     }
 
-    aabb box_l, box_r;
+    return cost;
+}
 
-    if (  ! left->bounding_box(time0, time1, box_l)
-       || ! right->bounding_box(time0, time1, box_r)
-    )
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+Float bvh_node::sah_cost(const bvh_build_params& params) const {
+    Float area = box.surface_area();
+    return area > 0 ? unnormalized_sah_cost(params) / area : 0;
+}
 
-    box = surrounding_box(box_l, box_r);
+aabb bvh_node::refit(Float time0, Float time1) {
+    aabb child_box;
+    box = aabb::empty();
+
+    if (is_leaf()) {
+        for (const auto& object : objects) {
+            object->bounding_box(time0, time1, child_box);
+            box = surrounding_box(box, child_box);
+        }
+        return box;
+    }
+
+    for (const auto& child : { left, right }) {
+        auto node = std::dynamic_pointer_cast<bvh_node>(child);
+        if (node)
+            child_box = node->refit(time0, time1);
+        else
+            child->bounding_box(time0, time1, child_box);
+        box = surrounding_box(box, child_box);
+    }
+
+    return box;
+}
+
+/*
+ * Build a BVH over objs and log the time spent in each phase
+ */
+shared_ptr<bvh_node> build_bvh(const std::vector<shared_ptr<hittable>>& objs, Float time0, Float time1,
+    const bvh_build_params& params, std::ostream& log
+) {
+    if (objs.empty())
+        return make_shared<bvh_node>(objs, time0, time1, params);
+
+    bvh_build_params p = params;
+    p.n_threads = resolve_thread_count(params.n_threads);
+
+    log << "\tBuilding over " << objs.size() << " primitives with " << p.n_threads << " threads\n" << std::flush;
+
+    Timer t;
+    t.start();
+    std::vector<bvh_primitive_info> info = compute_primitive_info(objs, time0, time1, p.n_threads);
+    log << "\tPrimitive bounds took " << t.elapsedMilli() << " milliseconds\n" << std::flush;
+
+    t.start();
+    auto root = make_shared<bvh_node>(objs, info, 0, objs.size(), p, 0, 0);
+    log << "\tTree construction took " << t.elapsedMilli() << " milliseconds\n" << std::flush;
+
+    if (p.split_method == bvh_split_method::sbvh) {
+        log << "\tSpatial splits: " << root->n_primitives << " references to " << objs.size() << " primitives ("
+            << 100.0 * (root->n_primitives - static_cast<Float>(objs.size())) / objs.size() << "% more, budget "
+            << 100 * p.spatial_split_budget << "%)\n";
+    }
+
+    t.start();
+    Float cost = root->sah_cost(p);
+    log << "\tSAH cost of tree: " << cost << " (evaluated in " << t.elapsedMilli() << " milliseconds)\n";
+
+    return root;
 }
 
-#endif //BVH_NODE_H
\ No newline at end of file
+#endif //BVH_NODE_H
@@ -0,0 +1,126 @@
+#ifndef BVH_REFIT_H
+#define BVH_REFIT_H
+
+#include <iostream>
+#include <vector>
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "bvh_node.hpp"
+#include "linear_bvh.hpp"
+#include "accelerator.hpp"
+#include "timing.hpp"
+
+/*
+ * Keeps the acceleration structure of a scene whose primitives move between
+ * frames but keep their topology. update() refits the existing tree in a
+ * single bottom up pass instead of building a new one. Refitting lets the
+ * tree quality drift, so once the SAH cost has grown by more than
+ * rebuild_threshold times the cost at the last build, the tree is rebuilt.
+ *
+ * The cost is measured from the first node that really divides the primitives.
+ * Above it, a node holding a few large primitives (a ground sphere) next to the
+ * rest of the scene makes the root so big that the normalized cost barely moves.
+ */
+class bvh_refitter {
+    public:
+        shared_ptr<bvh_node> tree;
+        shared_ptr<hittable> accel;
+
+        // SAH cost right after the last full build and after the last update
+        Float built_cost;
+        Float cost;
+
+        int n_refits = 0;
+        int n_rebuilds = 0;
+
+        bvh_refitter(const std::vector<shared_ptr<hittable>>& objs, shared_ptr<bvh_node> tree,
+            shared_ptr<hittable> accel, accel_type type, Float time0, Float time1,
+            const bvh_build_params& params, bool bake_triangles, Float rebuild_threshold);
+
+        // call after the primitives moved, returns the structure to render with
+        shared_ptr<hittable> update(std::ostream& log);
+
+    private:
+        Float quality_cost() const;
+
+        std::vector<shared_ptr<hittable>> objs;
+        accel_type type;
+        Float time0, time1;
+        bvh_build_params params;
+        bool bake_triangles;
+        Float rebuild_threshold;
+};
+
+bvh_refitter::bvh_refitter(const std::vector<shared_ptr<hittable>>& objs, shared_ptr<bvh_node> tree,
+    shared_ptr<hittable> accel, accel_type type, Float time0, Float time1,
+    const bvh_build_params& params, bool bake_triangles, Float rebuild_threshold)
+    : tree{ tree }, accel{ accel }, objs{ objs }, type{ type }, time0{ time0 }, time1{ time1 },
+      params{ params }, bake_triangles{ bake_triangles }, rebuild_threshold{ rebuild_threshold }
+{
+    built_cost = cost = quality_cost();
+}
+
+Float bvh_refitter::quality_cost() const {
+    const bvh_node* node = tree.get();
+
+    while (!node->is_leaf()) {
+        auto left = std::dynamic_pointer_cast<bvh_node>(node->left);
+        auto right = std::dynamic_pointer_cast<bvh_node>(node->right);
+
+        // descend while one child holds nearly all primitives
+        if (left && left->n_primitives >= 0.9 * node->n_primitives)
+            node = left.get();
+        else if (right && right->n_primitives >= 0.9 * node->n_primitives)
+            node = right.get();
+        else
+            break;
+    }
+
+    return node->sah_cost(params);
+}
+
+shared_ptr<hittable> bvh_refitter::update(std::ostream& log) {
+    Timer t;
+    t.start();
+
+    tree->refit(time0, time1);
+    cost = quality_cost();
+
+    if (cost > rebuild_threshold * built_cost) {
+        log << "\tSAH cost grew from " << built_cost << " to " << cost << ", rebuilding\n";
+        n_rebuilds++;
+
+        tree = build_bvh(objs, time0, time1, params, log);
+        accel = build_accelerator(tree, type, time0, time1, bake_triangles, log);
+        built_cost = cost = quality_cost();
+        return accel;
+    }
+
+    n_refits++;
+
+    // wide BVH leaves hold copies of the triangles, so they are collapsed again from the tree,
+    // motion nodes need boxes at both shutter ends and are flattened again as well
+    switch (type) {
+        case accel_type::linear:
+            std::static_pointer_cast<linear_bvh>(accel)->refit(time0, time1);
+            break;
+        case accel_type::bvh4:
+        case accel_type::bvh8:
+        case accel_type::cbvh4:
+        case accel_type::cbvh8:
+        case accel_type::motion:
+            accel = build_accelerator(tree, type, time0, time1, bake_triangles, log);
+            break;
+        case accel_type::tree:
+        default:
+            break;
+    }
+
+    log << "\tRefit in " << t.elapsedMilli() << " milliseconds, SAH cost " << cost
+        << " (" << cost / built_cost << "x the last build)\n";
+
+    return accel;
+}
+
+#endif //BVH_REFIT_H
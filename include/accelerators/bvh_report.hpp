@@ -0,0 +1,209 @@
+#ifndef BVH_REPORT_H
+#define BVH_REPORT_H
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "bvh_node.hpp"
+#include "camera.hpp"
+#include "stats.hpp"
+
+/*
+ * Shape of a built bvh_node tree, used to compare builders.
+ * Median builder nodes whose children are primitives count as leaves.
+ */
+struct bvh_quality {
+    int interior_nodes = 0;
+    int leaves = 0;
+    int primitives = 0;
+    int max_depth = 0;
+    Float mean_leaf_depth = 0;
+
+    // leaves per depth, and leaves per number of primitives
+    std::vector<int> depth_histogram;
+    std::map<int, int> leaf_size_histogram;
+
+    Float sah_cost = 0;
+
+    // area where the two child boxes of a node overlap, relative to the node
+    Float mean_overlap = 0;
+    Float max_overlap = 0;
+
+    // summed overlap area relative to the root, the extra cost it adds under the SAH
+    Float weighted_overlap = 0;
+};
+
+inline Float overlap_area(const aabb& a, const aabb& b) {
+    return intersect_boxes(a, b).surface_area();
+}
+
+void analyze_bvh_node(const bvh_node& node, int depth, bvh_quality& q, Float& depth_sum, Float& overlap_sum) {
+    auto left = std::dynamic_pointer_cast<bvh_node>(node.left);
+    auto right = std::dynamic_pointer_cast<bvh_node>(node.right);
+
+    if (node.is_leaf() || (!left && !right)) {
+        int size = node.is_leaf() ? node.objects.size() : (node.left == node.right ? 1 : 2);
+        q.leaves++;
+        q.primitives += size;
+        q.leaf_size_histogram[size]++;
+        if (static_cast<int>(q.depth_histogram.size()) <= depth) q.depth_histogram.resize(depth + 1, 0);
+        q.depth_histogram[depth]++;
+        q.max_depth = std::max(q.max_depth, depth);
+        depth_sum += depth;
+        return;
+    }
+
+    q.interior_nodes++;
+
+    aabb box_l, box_r;
+    node.left->bounding_box(0, 0, box_l);
+    node.right->bounding_box(0, 0, box_r);
+    Float overlap = overlap_area(box_l, box_r);
+    Float area = node.box.surface_area();
+    Float ratio = area > 0 ? overlap / area : 0;
+    overlap_sum += ratio;
+    q.max_overlap = std::max(q.max_overlap, ratio);
+    q.weighted_overlap += overlap;
+
+    // a primitive next to a subtree is a leaf of its own one level down
+    for (const auto& child : { node.left, node.right }) {
+        auto n = std::dynamic_pointer_cast<bvh_node>(child);
+        if (n) {
+            analyze_bvh_node(*n, depth + 1, q, depth_sum, overlap_sum);
+        } else {
+            q.leaves++;
+            q.primitives++;
+            q.leaf_size_histogram[1]++;
+            if (static_cast<int>(q.depth_histogram.size()) <= depth + 1) q.depth_histogram.resize(depth + 2, 0);
+            q.depth_histogram[depth + 1]++;
+            q.max_depth = std::max(q.max_depth, depth + 1);
+            depth_sum += depth + 1;
+        }
+    }
+}
+
+bvh_quality analyze_bvh(const bvh_node& root, const bvh_build_params& params) {
+    bvh_quality q;
+    Float depth_sum = 0;
+    Float overlap_sum = 0;
+
+    analyze_bvh_node(root, 0, q, depth_sum, overlap_sum);
+
+    q.sah_cost = root.sah_cost(params);
+    q.mean_leaf_depth = q.leaves > 0 ? depth_sum / q.leaves : 0;
+    q.mean_overlap = q.interior_nodes > 0 ? overlap_sum / q.interior_nodes : 0;
+    Float root_area = root.box.surface_area();
+    q.weighted_overlap = root_area > 0 ? q.weighted_overlap / root_area : 0;
+
+    return q;
+}
+
+void log_bvh_quality(const bvh_quality& q, std::ostream& log) {
+    log << "\t[BVH Report]\n";
+    log << "\t\t" << q.interior_nodes << " interior nodes, " << q.leaves << " leaves, "
+        << q.primitives << " primitive references\n";
+    log << "\t\tSAH cost " << q.sah_cost << "\n";
+    log << "\t\tDepth: max " << q.max_depth << ", mean leaf depth " << q.mean_leaf_depth << "\n";
+
+    log << "\t\tLeaves per depth:";
+    for (size_t d = 0; d < q.depth_histogram.size(); d++) {
+        if (q.depth_histogram[d] > 0) log << " " << d << ":" << q.depth_histogram[d];
+    }
+    log << "\n";
+
+    log << "\t\tLeaves per size:";
+    for (const auto& [size, count] : q.leaf_size_histogram) log << " " << size << ":" << count;
+    log << "\n";
+
+    log << "\t\tChild overlap: mean " << q.mean_overlap << ", max " << q.max_overlap
+        << " of the parent area, " << q.weighted_overlap << " of the root area summed\n";
+    log << "\t[/BVH Report]\n";
+}
+
+/*
+ * Node visits and primitive tests per ray for closest hit queries along a
+ * grid x grid set of camera rays through pixel centers, no bounces.
+ */
+ray_stats probe_traversal(const hittable& world, const camera& cam, int grid) {
+    ray_stats before = thread_ray_stats;
+    // a fixed seed, so every tree probed is given the same rays
+    sampler rng(1);
+
+    for (int j = 0; j < grid; j++) {
+        for (int i = 0; i < grid; i++) {
+            ray r = cam.get_ray((i + 0.5) / grid, (j + 0.5) / grid, rng);
+            hit_record rec;
+            world.hit(r, 0.001, infinity, rec);
+        }
+    }
+
+    ray_stats s;
+    s.rays = grid * grid;
+    s.nodes_visited = thread_ray_stats.nodes_visited - before.nodes_visited;
+    s.primitive_tests = thread_ray_stats.primitive_tests - before.primitive_tests;
+    thread_ray_stats = before;
+    return s;
+}
+
+void log_traversal_comparison(const char* name_a, const ray_stats& a, const char* name_b, const ray_stats& b,
+    std::ostream& log
+) {
+    auto per_ray = [](long long n, const ray_stats& s) { return static_cast<Float>(n) / s.rays; };
+
+    log << "\t[Traversal Comparison] " << a.rays << " camera rays\n";
+    for (const auto& [name, s] : { std::pair{ name_a, a }, std::pair{ name_b, b } }) {
+        log << "\t\t" << name << ": " << per_ray(s.nodes_visited, s) << " node visits, "
+            << per_ray(s.primitive_tests, s) << " primitive tests per ray\n";
+    }
+    log << "\t\t" << name_b << " visits " << static_cast<Float>(b.nodes_visited) / a.nodes_visited
+        << "x the nodes and tests " << static_cast<Float>(b.primitive_tests) / a.primitive_tests
+        << "x the primitives of " << name_a << "\n";
+    log << "\t[/Traversal Comparison]\n";
+}
+
+/*
+ * Memory held by a bvh_node tree. Nodes come from make_shared, which places
+ * each one after a control block of a vtable pointer and two reference counts.
+ * Leaf object lists add their vector storage, the primitives themselves are not counted.
+ */
+struct bvh_memory {
+    size_t nodes = 0;
+    size_t bytes = 0;
+
+    // nodes the same tree flattens to in a linear_bvh, primitives next to a subtree become leaves
+    size_t linear_nodes = 0;
+};
+
+const size_t shared_ptr_control_block_size = sizeof(void*) + 2 * sizeof(int);
+
+void measure_bvh_node(const bvh_node& node, bvh_memory& m) {
+    m.nodes++;
+    m.linear_nodes++;
+    m.bytes += sizeof(bvh_node) + shared_ptr_control_block_size
+        + node.objects.capacity() * sizeof(shared_ptr<hittable>);
+
+    if (node.is_leaf()) return;
+
+    auto left = std::dynamic_pointer_cast<bvh_node>(node.left);
+    auto right = std::dynamic_pointer_cast<bvh_node>(node.right);
+    if (!left && !right) return;
+
+    for (const auto& child : { left, right }) {
+        if (child)
+            measure_bvh_node(*child, m);
+        else
+            m.linear_nodes++;
+    }
+}
+
+bvh_memory measure_bvh(const bvh_node& root) {
+    bvh_memory m;
+    measure_bvh_node(root, m);
+    return m;
+}
+
+#endif //BVH_REPORT_H
@@ -0,0 +1,319 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "bvh_node.hpp"
+#include "wide_bvh.hpp"
+
+// 2^e as a float built from its bits, e must be in the normal range [-126, 127]
+inline float exp2_float(int e) {
+    uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/*
+ * Wide BVH node with the child boxes quantized to 8 bits per plane.
+ * The node stores a frame per axis, an origin and a power of two scale,
+ * and a child bound decodes to origin + q * scale. q * scale is exact, so the
+ * decode rounds only once, and the quantized values are chosen at build time
+ * so that the decoded box always contains the real one.
+ * An 8 wide node is 96 bytes instead of 256 for wide_bvh_node<8>.
+ */
+template<int N>
+struct alignas(32) compressed_bvh_node {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t n_children;
+    uint8_t q_min[3][N];
+    uint8_t q_max[3][N];
+    int32_t child[N];
+
+    float scale(int a) const { return exp2_float(exponent[a]); }
+
+    float decode(int a, int q) const { return origin[a] + static_cast<float>(q) * scale(a); }
+
+    // quantize the child boxes of node, children and their order are kept
+    void quantize(const wide_bvh_node<N>& node);
+
+    /*
+     * Largest growth in surface area quantizing caused to a child of node.
+     * Children below 2^-16 of the node's area are skipped, any growth is large relative to them.
+     */
+    float inflation(const wide_bvh_node<N>& node) const;
+
+    private:
+        // false if some child does not fit in 255 steps of the scale
+        bool quantize_axis(const wide_bvh_node<N>& node, int a);
+};
+
+template<int N>
+void compressed_bvh_node<N>::quantize(const wide_bvh_node<N>& node) {
+    n_children = node.n_children;
+    for (int i = 0; i < N; i++) child[i] = node.child[i];
+
+    for (int a = 0; a < 3; a++) {
+        float lo = std::numeric_limits<float>::max();
+        float hi = -std::numeric_limits<float>::max();
+        for (int i = 0; i < n_children; i++) {
+            lo = std::min(lo, node.bounds_min[a][i]);
+            hi = std::max(hi, node.bounds_max[a][i]);
+        }
+        if (n_children == 0) lo = hi = 0;
+        origin[a] = lo;
+
+        // smallest scale that spans the parent, raised if rounding pushes a child past 255 steps
+        double extent = static_cast<double>(hi) - lo;
+        int e = extent > 0 ? static_cast<int>(std::ceil(std::log2(extent / 255))) : -126;
+        e = std::clamp(e, -126, 127);
+        for (exponent[a] = e; !quantize_axis(node, a); exponent[a]++) {}
+    }
+}
+
+template<int N>
+bool compressed_bvh_node<N>::quantize_axis(const wide_bvh_node<N>& node, int a) {
+    const double s = scale(a);
+
+    for (int i = 0; i < N; i++) {
+        if (i >= n_children) {
+            q_min[a][i] = q_max[a][i] = 0;
+            continue;
+        }
+
+        float lo = node.bounds_min[a][i], hi = node.bounds_max[a][i];
+
+        // decode(0) is the origin, which is at or below every child
+        int q_lo = std::clamp(static_cast<int>(std::floor((lo - origin[a]) / s)), 0, 255);
+        while (q_lo > 0 && decode(a, q_lo) > lo) q_lo--;
+
+        int q_hi = std::max(q_lo, static_cast<int>(std::ceil((hi - origin[a]) / s)));
+        while (q_hi <= 255 && decode(a, q_hi) < hi) q_hi++;
+        if (q_hi > 255) {
+            if (exponent[a] == 127) q_hi = 255; // cannot grow, only reached for boxes near float max
+            else return false;
+        }
+
+        q_min[a][i] = q_lo;
+        q_max[a][i] = q_hi;
+    }
+    return true;
+}
+
+template<int N>
+float compressed_bvh_node<N>::inflation(const wide_bvh_node<N>& node) const {
+    auto area = [](const float e[3]) { return e[0] * e[1] + e[1] * e[2] + e[2] * e[0]; };
+
+    float parent[3] = { 0, 0, 0 };
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < n_children; i++)
+            parent[a] = std::max(parent[a], node.bounds_max[a][i] - origin[a]);
+    }
+    const float min_area = area(parent) / 65536;
+
+    float worst = 1;
+    for (int i = 0; i < n_children; i++) {
+        float exact[3], decoded[3];
+        for (int a = 0; a < 3; a++) {
+            exact[a] = node.bounds_max[a][i] - node.bounds_min[a][i];
+            decoded[a] = decode(a, q_max[a][i]) - decode(a, q_min[a][i]);
+        }
+        if (area(exact) > min_area) worst = std::max(worst, area(decoded) / area(exact));
+    }
+    return worst;
+}
+
+/*
+ * Same test as intersect_children on a wide_bvh_node, after decoding the child
+ * bounds with the exact arithmetic used when quantizing.
+ */
+template<int N>
+inline int intersect_children(const compressed_bvh_node<N>& node, const wide_bvh_ray& wr,
+        float t_min, float t_max, float t_near[N]) {
+    int mask = 0;
+    for (int i = 0; i < node.n_children; i++) {
+        float t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; a++) {
+            float s0 = (node.decode(a, node.q_min[a][i]) - wr.orig[a]) * wr.inv_dir[a];
+            float s1 = (node.decode(a, node.q_max[a][i]) - wr.orig[a]) * wr.inv_dir[a];
+            t0 = std::max(t0, std::min(s0, s1));
+            t1 = std::min(t1, std::max(s0, s1) * wide_bvh_widen);
+        }
+        t_near[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#if defined(__SSE4_1__)
+template<>
+inline int intersect_children<4>(const compressed_bvh_node<4>& node, const wide_bvh_ray& wr,
+        float t_min, float t_max, float t_near[4]) {
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    const __m128 widen = _mm_set1_ps(wide_bvh_widen);
+
+    for (int a = 0; a < 3; a++) {
+        int32_t q_min, q_max;
+        std::memcpy(&q_min, node.q_min[a], 4);
+        std::memcpy(&q_max, node.q_max[a], 4);
+
+        __m128 origin = _mm_set1_ps(node.origin[a]);
+        __m128 scale = _mm_set1_ps(node.scale(a));
+        __m128 lo = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(q_min))), scale));
+        __m128 hi = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(q_max))), scale));
+
+        __m128 o = _mm_set1_ps(wr.orig[a]);
+        __m128 inv = _mm_set1_ps(wr.inv_dir[a]);
+        __m128 s0 = _mm_mul_ps(_mm_sub_ps(lo, o), inv);
+        __m128 s1 = _mm_mul_ps(_mm_sub_ps(hi, o), inv);
+        t0 = _mm_max_ps(t0, _mm_min_ps(s0, s1));
+        t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_max_ps(s0, s1), widen));
+    }
+
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.n_children) - 1);
+}
+#endif
+
+#if defined(__AVX2__)
+template<>
+inline int intersect_children<8>(const compressed_bvh_node<8>& node, const wide_bvh_ray& wr,
+        float t_min, float t_max, float t_near[8]) {
+    __m256 t0 = _mm256_set1_ps(t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    const __m256 widen = _mm256_set1_ps(wide_bvh_widen);
+
+    for (int a = 0; a < 3; a++) {
+        __m128i q_min = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.q_min[a]));
+        __m128i q_max = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.q_max[a]));
+
+        __m256 origin = _mm256_set1_ps(node.origin[a]);
+        __m256 scale = _mm256_set1_ps(node.scale(a));
+        __m256 lo = _mm256_add_ps(origin, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(q_min)), scale));
+        __m256 hi = _mm256_add_ps(origin, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(q_max)), scale));
+
+        __m256 o = _mm256_set1_ps(wr.orig[a]);
+        __m256 inv = _mm256_set1_ps(wr.inv_dir[a]);
+        __m256 s0 = _mm256_mul_ps(_mm256_sub_ps(lo, o), inv);
+        __m256 s1 = _mm256_mul_ps(_mm256_sub_ps(hi, o), inv);
+        t0 = _mm256_max_ps(t0, _mm256_min_ps(s0, s1));
+        t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_max_ps(s0, s1), widen));
+    }
+
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & ((1 << node.n_children) - 1);
+}
+#endif
+
+/*
+ * Nodes of a compressed_bvh as traverse() sees them. Indices below the
+ * number of exact nodes are full precision nodes, the rest are quantized.
+ */
+template<int N>
+struct compressed_bvh_node_set {
+    const std::vector<wide_bvh_node<N>>& exact_nodes;
+    const std::vector<compressed_bvh_node<N>>& compressed_nodes;
+
+    bool empty() const { return exact_nodes.empty(); }
+
+    int intersect(int32_t index, const wide_bvh_ray& wr, float t_min, float t_max, float t_near[N],
+            const int32_t*& child) const {
+        const int32_t n_exact = exact_nodes.size();
+        if (index < n_exact) {
+            child = exact_nodes[index].child;
+            return intersect_children<N>(exact_nodes[index], wr, t_min, t_max, t_near);
+        }
+        const compressed_bvh_node<N>& node = compressed_nodes[index - n_exact];
+        child = node.child;
+        return intersect_children<N>(node, wr, t_min, t_max, t_near);
+    }
+};
+
+/*
+ * wide_bvh<N> with its nodes quantized once collapsed. Leaves, triangle clusters
+ * and the traversal are shared with wide_bvh.
+ * A node whose children differ wildly in size, such as a ground plane next to a
+ * mesh, cannot describe the small ones in 255 steps of the large one. Nodes where
+ * quantizing grows a child's area more than max_inflation times stay full precision,
+ * in the nodes of the base class, and are numbered before the quantized ones.
+ */
+template<int N>
+class compressed_bvh : public wide_bvh<N> {
+    public:
+        static constexpr float max_inflation = 1.25f;
+
+        std::vector<compressed_bvh_node<N>> compressed_nodes;
+
+        compressed_bvh(const bvh_node& root, Float time0, Float time1, bool bake_triangles = true);
+
+        virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
+        // nodes kept at full precision, the root is always one of them
+        size_t exact_node_count() const { return this->nodes.size(); }
+};
+
+template<int N>
+compressed_bvh<N>::compressed_bvh(const bvh_node& root, Float time0, Float time1, bool bake_triangles)
+: wide_bvh<N>(root, time0, time1, bake_triangles) {
+    const size_t n = this->nodes.size();
+
+    std::vector<compressed_bvh_node<N>> quantized(n);
+    std::vector<bool> exact(n);
+    int32_t n_exact = 0;
+    for (size_t i = 0; i < n; i++) {
+        quantized[i].quantize(this->nodes[i]);
+        exact[i] = i == 0 || quantized[i].inflation(this->nodes[i]) > max_inflation;
+        n_exact += exact[i];
+    }
+
+    // exact nodes first in their original order, so the root stays at 0
+    std::vector<int32_t> new_index(n);
+    int32_t next_exact = 0, next_quantized = n_exact;
+    for (size_t i = 0; i < n; i++)
+        new_index[i] = exact[i] ? next_exact++ : next_quantized++;
+
+    std::vector<wide_bvh_node<N>> exact_nodes;
+    exact_nodes.reserve(n_exact);
+    compressed_nodes.reserve(n - n_exact);
+
+    for (size_t i = 0; i < n; i++) {
+        int32_t* child = exact[i] ? this->nodes[i].child : quantized[i].child;
+        for (int c = 0; c < this->nodes[i].n_children; c++) {
+            if (child[c] >= 0) child[c] = new_index[child[c]];
+        }
+
+        if (exact[i])
+            exact_nodes.push_back(this->nodes[i]);
+        else
+            compressed_nodes.push_back(quantized[i]);
+    }
+
+    this->nodes = std::move(exact_nodes);
+}
+
+template<int N>
+bool compressed_bvh<N>::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    return this->template traverse<false>(compressed_bvh_node_set<N>{ this->nodes, compressed_nodes }, r, t_min, t_max, rec);
+}
+
+template<int N>
+bool compressed_bvh<N>::occluded(const ray& r, Float t_min, Float t_max) const {
+    hit_record unused;
+    return this->template traverse<true>(compressed_bvh_node_set<N>{ this->nodes, compressed_nodes }, r, t_min, t_max, unused);
+}
+
+#endif //COMPRESSED_BVH_H
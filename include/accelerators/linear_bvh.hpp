@@ -0,0 +1,435 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+#endif
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "bvh_node.hpp"
+#include "stats.hpp"
+
+/*
+ * Slab test against a ray with precomputed reciprocal direction.
+ * Comparisons are written so NaNs from 0 * inf fail and leave the interval unchanged.
+ */
+inline bool slab_hit(const float bounds[2][3], const float orig[3], const float inv_dir[3],
+    const int dir_is_neg[3], float t_min, float t_max) {
+    float t0 = (bounds[dir_is_neg[0]][0] - orig[0]) * inv_dir[0];
+    float t1 = (bounds[1 - dir_is_neg[0]][0] - orig[0]) * inv_dir[0];
+
+    // widen the far distance to account for float rounding in the subtraction and product
+    const float widen = 1 + 2 * 3 * std::numeric_limits<float>::epsilon();
+
+    t1 *= widen;
+    if (t0 > t_min) t_min = t0;
+    if (t1 < t_max) t_max = t1;
+    if (t_min > t_max) return false;
+
+    t0 = (bounds[dir_is_neg[1]][1] - orig[1]) * inv_dir[1];
+    t1 = (bounds[1 - dir_is_neg[1]][1] - orig[1]) * inv_dir[1] * widen;
+    if (t0 > t_min) t_min = t0;
+    if (t1 < t_max) t_max = t1;
+    if (t_min > t_max) return false;
+
+    t0 = (bounds[dir_is_neg[2]][2] - orig[2]) * inv_dir[2];
+    t1 = (bounds[1 - dir_is_neg[2]][2] - orig[2]) * inv_dir[2] * widen;
+    if (t0 > t_min) t_min = t0;
+    if (t1 < t_max) t_max = t1;
+    return t_min <= t_max;
+}
+
+/*
+ * Slab test of one box against the lanes of a packet set in mask, each against its own t_max.
+ * Returns the lanes that hit. With AVX, 8 lanes are tested at once, the near and
+ * far planes are picked per lane, and NaNs from 0 * inf leave the interval unchanged
+ * because max and min return their second operand when either one is NaN.
+ */
+inline uint32_t packet_slab_hit(const float bounds[2][3], const ray_packet& p, float t_min, uint32_t mask) {
+    const float widen = 1 + 2 * 3 * std::numeric_limits<float>::epsilon();
+    uint32_t hit = 0;
+
+#if defined(__AVX__)
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 widen8 = _mm256_set1_ps(widen);
+
+    for (int c = 0; c < p.size; c += 8) {
+        __m256 t0 = _mm256_set1_ps(t_min);
+        __m256 t1 = _mm256_load_ps(&p.t_max_f[c]);
+
+        for (int a = 0; a < 3; a++) {
+            __m256 o = _mm256_load_ps(&p.orig[a][c]);
+            __m256 inv = _mm256_load_ps(&p.inv_dir[a][c]);
+            __m256 s0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[0][a]), o), inv);
+            __m256 s1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[1][a]), o), inv);
+
+            __m256 neg = _mm256_cmp_ps(inv, zero, _CMP_LT_OQ);
+            __m256 near = _mm256_blendv_ps(s0, s1, neg);
+            __m256 far = _mm256_mul_ps(_mm256_blendv_ps(s1, s0, neg), widen8);
+            t0 = _mm256_max_ps(near, t0);
+            t1 = _mm256_min_ps(far, t1);
+        }
+
+        hit |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ))) << c;
+    }
+#else
+    for (int i = 0; i < p.size; i++) {
+        float t0 = t_min, t1 = p.t_max_f[i];
+        for (int a = 0; a < 3; a++) {
+            int neg = p.inv_dir[a][i] < 0;
+            float near = (bounds[neg][a] - p.orig[a][i]) * p.inv_dir[a][i];
+            float far = (bounds[1 - neg][a] - p.orig[a][i]) * p.inv_dir[a][i] * widen;
+            if (near > t0) t0 = near;
+            if (far < t1) t1 = far;
+        }
+        if (t0 <= t1) hit |= 1u << i;
+    }
+#endif
+
+    return hit & mask;
+}
+
+/*
+ * A BVH node packed into 32 bytes so two nodes share a cache line.
+ * Bounds are stored as float even when Float is double, rounded outwards
+ * so the stored box always contains the real one.
+ * Nodes are laid out depth first, the first child of an interior node
+ * directly follows it and the second child is at second_child_offset.
+ */
+struct alignas(32) linear_bvh_node {
+    float bounds[2][3]; // bounds[0] is min, bounds[1] is max
+
+    union {
+        int32_t primitives_offset;   // leaf
+        int32_t second_child_offset; // interior
+    };
+
+    uint16_t n_primitives; // 0 for interior nodes
+    uint8_t axis;          // split axis of an interior node
+    uint8_t pad;
+
+    void set_bounds(const aabb& box) {
+        bounds[0][0] = round_down_to_float(box.min.x);
+        bounds[0][1] = round_down_to_float(box.min.y);
+        bounds[0][2] = round_down_to_float(box.min.z);
+        bounds[1][0] = round_up_to_float(box.max.x);
+        bounds[1][1] = round_up_to_float(box.max.y);
+        bounds[1][2] = round_up_to_float(box.max.z);
+    }
+
+    bool hit(const float orig[3], const float inv_dir[3], const int dir_is_neg[3],
+            float t_min, float t_max) const {
+        return slab_hit(bounds, orig, inv_dir, dir_is_neg, t_min, t_max);
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+/*
+ * Flattened BVH built from a bvh_node tree.
+ * Primitives are reordered so every leaf references a contiguous range,
+ * traversal is an explicit stack loop that visits the near child first.
+ */
+class linear_bvh : public hittable {
+    public:
+        std::vector<linear_bvh_node> nodes;
+
+        // owning references in leaf order, and raw pointers to the same
+        // objects so traversal never touches a reference count
+        std::vector<shared_ptr<hittable>> primitives;
+        std::vector<const hittable*> primitive_ptrs;
+
+        aabb box;
+
+        linear_bvh(const bvh_node& root, Float time0, Float time1);
+
+        // traverse nodes stored elsewhere, such as a mapped cache file, storage keeps them alive
+        linear_bvh(const linear_bvh_node* node_data, size_t n_nodes,
+            const std::vector<shared_ptr<hittable>>& primitives, const aabb& box, shared_ptr<const void> storage);
+
+        size_t node_count() const { return n_nodes; }
+
+        // the nodes traversed, nodes.data() unless they live in external storage
+        const linear_bvh_node* node_data() const { return nodes_ptr; }
+
+        // recompute the node bounds in place after the primitives moved
+        void refit(Float time0, Float time1);
+
+        // box of every node over [time0, time1] from the current primitives, in node order
+        std::vector<aabb> node_boxes(Float time0, Float time1) const;
+
+        virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
+        virtual void hit_packet(ray_packet& packet, Float t_min, hit_record recs[]) const override;
+
+        virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override;
+
+    private:
+        const linear_bvh_node* nodes_ptr = nullptr;
+        size_t n_nodes = 0;
+        shared_ptr<const void> storage;
+
+        int flatten(const bvh_node& node, Float time0, Float time1);
+
+        int flatten_leaf(const aabb& box, const std::vector<shared_ptr<hittable>>& objs);
+
+        // closest hit into rec, or with any_hit true stop at the first hit and leave rec alone
+        template<bool any_hit>
+        bool traverse(const ray& r, Float t_min, Float t_max, hit_record& rec) const;
+};
+
+linear_bvh::linear_bvh(const bvh_node& root, Float time0, Float time1) : box{ root.box } {
+    flatten(root, time0, time1);
+    nodes_ptr = nodes.data();
+    n_nodes = nodes.size();
+
+    primitive_ptrs.reserve(primitives.size());
+    for (const auto& p : primitives) primitive_ptrs.push_back(p.get());
+}
+
+linear_bvh::linear_bvh(const linear_bvh_node* node_data, size_t n_nodes,
+    const std::vector<shared_ptr<hittable>>& primitives, const aabb& box, shared_ptr<const void> storage)
+: primitives{ primitives }, box{ box }, nodes_ptr{ node_data }, n_nodes{ n_nodes }, storage{ storage } {
+    primitive_ptrs.reserve(primitives.size());
+    for (const auto& p : primitives) primitive_ptrs.push_back(p.get());
+}
+
+bool linear_bvh::bounding_box(Float, Float, aabb& output_box) const {
+    output_box = box;
+    return true;
+}
+
+int linear_bvh::flatten_leaf(const aabb& box, const std::vector<shared_ptr<hittable>>& objs) {
+    int offset = nodes.size();
+    nodes.emplace_back();
+    linear_bvh_node& n = nodes.back();
+    n.set_bounds(box);
+    n.primitives_offset = primitives.size();
+    n.n_primitives = objs.size();
+    n.axis = 0;
+    n.pad = 0;
+    for (const auto& o : objs) primitives.push_back(o);
+    return offset;
+}
+
+int linear_bvh::flatten(const bvh_node& node, Float time0, Float time1) {
+    if (node.is_leaf())
+        return flatten_leaf(node.box, node.objects);
+
+    auto left = std::dynamic_pointer_cast<bvh_node>(node.left);
+    auto right = std::dynamic_pointer_cast<bvh_node>(node.right);
+
+    // median builder leaves, children are primitives and a span of 1 stores the same one twice
+    if (!left && !right) {
+        if (node.left == node.right)
+            return flatten_leaf(node.box, { node.left });
+        return flatten_leaf(node.box, { node.left, node.right });
+    }
+
+    int offset = nodes.size();
+    nodes.emplace_back();
+    nodes[offset].set_bounds(node.box);
+    nodes[offset].n_primitives = 0;
+    nodes[offset].axis = node.split_axis;
+    nodes[offset].pad = 0;
+
+    aabb child_box;
+    if (left) {
+        flatten(*left, time0, time1);
+    } else {
+        node.left->bounding_box(time0, time1, child_box);
+        flatten_leaf(child_box, { node.left });
+    }
+
+    int second;
+    if (right) {
+        second = flatten(*right, time0, time1);
+    } else {
+        node.right->bounding_box(time0, time1, child_box);
+        second = flatten_leaf(child_box, { node.right });
+    }
+    // nodes may have been reallocated while flattening, index again instead of holding a reference
+    nodes[offset].second_child_offset = second;
+
+    return offset;
+}
+
+/*
+ * Children are always stored after their parent, so a single backwards
+ * pass sees both children of a node before the node itself.
+ */
+std::vector<aabb> linear_bvh::node_boxes(Float time0, Float time1) const {
+    std::vector<aabb> boxes(n_nodes);
+
+    for (int i = static_cast<int>(n_nodes) - 1; i >= 0; i--) {
+        const linear_bvh_node& n = nodes_ptr[i];
+        aabb b = aabb::empty();
+
+        if (n.n_primitives > 0) {
+            aabb prim_box;
+            for (int j = 0; j < n.n_primitives; j++) {
+                primitive_ptrs[n.primitives_offset + j]->bounding_box(time0, time1, prim_box);
+                b = surrounding_box(b, prim_box);
+            }
+        } else {
+            b = surrounding_box(boxes[i + 1], boxes[n.second_child_offset]);
+        }
+
+        boxes[i] = b;
+    }
+
+    return boxes;
+}
+
+// boxes are accumulated in Float and only rounded when stored
+void linear_bvh::refit(Float time0, Float time1) {
+    // external nodes are read only, take a copy to write to
+    if (nodes_ptr != nodes.data()) {
+        nodes.assign(nodes_ptr, nodes_ptr + n_nodes);
+        nodes_ptr = nodes.data();
+        storage.reset();
+    }
+
+    std::vector<aabb> boxes = node_boxes(time0, time1);
+    for (size_t i = 0; i < nodes.size(); i++)
+        nodes[i].set_bounds(boxes[i]);
+
+    box = boxes.empty() ? aabb::empty() : boxes[0];
+}
+
+bool linear_bvh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    return traverse<false>(r, t_min, t_max, rec);
+}
+
+bool linear_bvh::occluded(const ray& r, Float t_min, Float t_max) const {
+    hit_record unused;
+    return traverse<true>(r, t_min, t_max, unused);
+}
+
+template<bool any_hit>
+bool linear_bvh::traverse(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    if (n_nodes == 0) return false;
+
+    float orig[3] = { static_cast<float>(r.orig.x), static_cast<float>(r.orig.y), static_cast<float>(r.orig.z) };
+    float inv_dir[3] = {
+        static_cast<float>(1 / r.dir.x), static_cast<float>(1 / r.dir.y), static_cast<float>(1 / r.dir.z)
+    };
+    int dir_is_neg[3] = { inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0 };
+
+    bool hit_anything = false;
+    long long nodes_visited = 0;
+
+    int to_visit[bvh_stack_size];
+    int to_visit_offset = 0;
+    int current = 0;
+
+    while (true) {
+        const linear_bvh_node& node = nodes_ptr[current];
+        nodes_visited++;
+
+        if (node.hit(orig, inv_dir, dir_is_neg, static_cast<float>(t_min), static_cast<float>(t_max))) {
+            if (node.n_primitives > 0) {
+                const hittable* const* prims = &primitive_ptrs[node.primitives_offset];
+                for (int i = 0; i < node.n_primitives; i++) {
+                    if (any_hit) {
+                        if (prims[i]->occluded(r, t_min, t_max)) {
+                            hit_anything = true;
+                            break;
+                        }
+                    } else if (prims[i]->hit(r, t_min, t_max, rec)) {
+                        hit_anything = true;
+                        t_max = rec.t;
+                    }
+                }
+
+                if (to_visit_offset == 0 || (any_hit && hit_anything)) break;
+                current = to_visit[--to_visit_offset];
+            } else {
+                // visit the child on the near side of the split plane first
+                if (dir_is_neg[node.axis]) {
+                    to_visit[to_visit_offset++] = current + 1;
+                    current = node.second_child_offset;
+                } else {
+                    to_visit[to_visit_offset++] = node.second_child_offset;
+                    current = current + 1;
+                }
+            }
+        } else {
+            if (to_visit_offset == 0) break;
+            current = to_visit[--to_visit_offset];
+        }
+    }
+
+    thread_ray_stats.nodes_visited += nodes_visited;
+
+    return hit_anything;
+}
+
+/*
+ * The packet walks the tree together, each node is fetched once and tested
+ * against all lanes still active under it. Lanes whose rays miss a node drop
+ * out of that subtree, and leaves only test primitives for the lanes that reached them.
+ * Children are visited near side first for the first active lane.
+ */
+void linear_bvh::hit_packet(ray_packet& packet, Float t_min, hit_record recs[]) const {
+    if (n_nodes == 0 || packet.size == 0) return;
+
+    struct stack_entry {
+        int node;
+        uint32_t mask;
+    };
+
+    const float t_min_f = static_cast<float>(t_min);
+    long long nodes_visited = 0;
+
+    stack_entry to_visit[bvh_stack_size];
+    int to_visit_offset = 0;
+    int current = 0;
+    uint32_t mask = packet.lanes();
+
+    while (true) {
+        const linear_bvh_node& node = nodes_ptr[current];
+        nodes_visited++;
+
+        mask = packet_slab_hit(node.bounds, packet, t_min_f, mask);
+
+        if (mask && node.n_primitives == 0) {
+            int lead = __builtin_ctz(mask);
+            if (packet.inv_dir[node.axis][lead] < 0) {
+                to_visit[to_visit_offset++] = { current + 1, mask };
+                current = node.second_child_offset;
+            } else {
+                to_visit[to_visit_offset++] = { node.second_child_offset, mask };
+                current = current + 1;
+            }
+            continue;
+        }
+
+        if (mask) {
+            const hittable* const* prims = &primitive_ptrs[node.primitives_offset];
+            for (uint32_t m = mask; m; m &= m - 1) {
+                int i = __builtin_ctz(m);
+                for (int j = 0; j < node.n_primitives; j++) {
+                    if (prims[j]->hit(packet.rays[i], t_min, packet.t_max[i], recs[i]))
+                        packet.record_hit(i, recs[i].t);
+                }
+            }
+        }
+
+        if (to_visit_offset == 0) break;
+        to_visit_offset--;
+        current = to_visit[to_visit_offset].node;
+        mask = to_visit[to_visit_offset].mask;
+    }
+
+    thread_ray_stats.nodes_visited += nodes_visited;
+}
+
+#endif //LINEAR_BVH_H
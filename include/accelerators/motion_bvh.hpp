@@ -0,0 +1,302 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "bvh_node.hpp"
+#include "linear_bvh.hpp"
+#include "timing.hpp"
+#include "stats.hpp"
+
+/*
+ * Linear BVH node with bounds at both ends of its time segment.
+ * A ray interpolates the two boxes at its own time, so a moving primitive
+ * only covers where it is at that time instead of its whole path.
+ * Linear interpolation of the endpoint boxes is conservative for primitives
+ * that move linearly, the union of boxes moving linearly is convex in time.
+ */
+struct alignas(64) motion_bvh_node {
+    float bounds[2][2][3]; // bounds[time][min or max][axis]
+
+    union {
+        int32_t primitives_offset;   // leaf
+        int32_t second_child_offset; // interior
+    };
+
+    uint16_t n_primitives; // 0 for interior nodes
+    uint8_t axis;          // split axis of an interior node
+    uint8_t pad;
+
+    /*
+     * Interpolating in float can land a couple of ulps inside the real box.
+     * Both ends are moved out by more than that when storing, so the
+     * interpolated box stays conservative without extra work per test.
+     */
+    void set_bounds(const aabb& box0, const aabb& box1) {
+        const float eps = 4 * std::numeric_limits<float>::epsilon();
+
+        for (int a = 0; a < 3; a++) {
+            float lo0 = round_down_to_float(box0.min[a]), lo1 = round_down_to_float(box1.min[a]);
+            float hi0 = round_up_to_float(box0.max[a]), hi1 = round_up_to_float(box1.max[a]);
+            float lo_pad = eps * std::max(std::fabs(lo0), std::fabs(lo1));
+            float hi_pad = eps * std::max(std::fabs(hi0), std::fabs(hi1));
+            bounds[0][0][a] = lo0 - lo_pad;
+            bounds[1][0][a] = lo1 - lo_pad;
+            bounds[0][1][a] = hi0 + hi_pad;
+            bounds[1][1][a] = hi1 + hi_pad;
+        }
+    }
+
+    // w is the ray time relative to the segment, 0 at its start and 1 at its end
+    bool hit(const float orig[3], const float inv_dir[3], const int dir_is_neg[3],
+            float t_min, float t_max, float w) const {
+        float b[2][3];
+        for (int a = 0; a < 3; a++) {
+            float lo0 = bounds[0][0][a], lo1 = bounds[1][0][a];
+            float hi0 = bounds[0][1][a], hi1 = bounds[1][1][a];
+            b[0][a] = lo0 + w * (lo1 - lo0);
+            b[1][a] = hi0 + w * (hi1 - hi0);
+        }
+
+        return slab_hit(b, orig, inv_dir, dir_is_neg, t_min, t_max);
+    }
+};
+
+static_assert(sizeof(motion_bvh_node) == 64, "motion_bvh_node should be 64 bytes");
+
+/*
+ * Motion blur aware BVH. The shutter is split into equal time segments with
+ * a separate tree each, a ray only traverses the tree for its own time.
+ * Within a segment the node boxes are interpolated by ray time.
+ * More segments give tighter boxes for fast movers at the cost of
+ * referencing every primitive once per segment.
+ */
+class motion_bvh : public hittable {
+    public:
+        struct segment {
+            std::vector<motion_bvh_node> nodes;
+            std::vector<shared_ptr<hittable>> primitives;
+            std::vector<const hittable*> primitive_ptrs;
+        };
+
+        std::vector<segment> segments;
+
+        aabb box;
+
+        // trees[i] covers segment i of the shutter, every segment has the same length
+        motion_bvh(const std::vector<shared_ptr<bvh_node>>& trees, Float time0, Float time1);
+
+        virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
+        virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override;
+
+        size_t node_count() const;
+
+    private:
+        Float time0, time1;
+
+        // closest hit into rec, or with any_hit true stop at the first hit and leave rec alone
+        template<bool any_hit>
+        bool traverse(const ray& r, Float t_min, Float t_max, hit_record& rec) const;
+};
+
+/*
+ * The topology comes from flattening each tree into a linear_bvh,
+ * its node boxes at the segment ends give the two sets of bounds.
+ */
+motion_bvh::motion_bvh(const std::vector<shared_ptr<bvh_node>>& trees, Float time0, Float time1)
+: box{ aabb::empty() }, time0{ time0 }, time1{ time1 } {
+    const int n_segments = trees.size();
+    segments.resize(n_segments);
+
+    for (int s = 0; s < n_segments; s++) {
+        Float seg_t0 = time0 + (time1 - time0) * s / n_segments;
+        Float seg_t1 = time0 + (time1 - time0) * (s + 1) / n_segments;
+
+        linear_bvh lbvh(*trees[s], seg_t0, seg_t1);
+        segment& seg = segments[s];
+        seg.nodes.resize(lbvh.nodes.size());
+
+        for (size_t i = 0; i < lbvh.nodes.size(); i++) {
+            const linear_bvh_node& ln = lbvh.nodes[i];
+            motion_bvh_node& mn = seg.nodes[i];
+            mn.primitives_offset = ln.primitives_offset;
+            mn.n_primitives = ln.n_primitives;
+            mn.axis = ln.axis;
+            mn.pad = 0;
+        }
+
+        std::vector<aabb> boxes0 = lbvh.node_boxes(seg_t0, seg_t0);
+        std::vector<aabb> boxes1 = lbvh.node_boxes(seg_t1, seg_t1);
+        for (size_t i = 0; i < lbvh.nodes.size(); i++)
+            seg.nodes[i].set_bounds(boxes0[i], boxes1[i]);
+
+        seg.primitives = std::move(lbvh.primitives);
+        seg.primitive_ptrs = std::move(lbvh.primitive_ptrs);
+        box = surrounding_box(box, trees[s]->box);
+    }
+}
+
+bool motion_bvh::bounding_box(Float, Float, aabb& output_box) const {
+    output_box = box;
+    return true;
+}
+
+size_t motion_bvh::node_count() const {
+    size_t n = 0;
+    for (const auto& seg : segments) n += seg.nodes.size();
+    return n;
+}
+
+bool motion_bvh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    return traverse<false>(r, t_min, t_max, rec);
+}
+
+bool motion_bvh::occluded(const ray& r, Float t_min, Float t_max) const {
+    hit_record unused;
+    return traverse<true>(r, t_min, t_max, unused);
+}
+
+template<bool any_hit>
+bool motion_bvh::traverse(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    const int n_segments = segments.size();
+
+    // position of the ray inside the shutter, in units of segments. A closed shutter
+    // has only the start boxes, and u is clamped before the cast, so it always fits an int
+    int s = 0;
+    float w = 0;
+    if (time1 > time0) {
+        Float u = clamp((r.ray_time() - time0) / (time1 - time0) * n_segments, 0, n_segments);
+        s = std::min(static_cast<int>(u), n_segments - 1);
+        w = static_cast<float>(clamp(u - s, 0, 1));
+    }
+
+    const segment& seg = segments[s];
+    if (seg.nodes.empty()) return false;
+
+    float orig[3] = { static_cast<float>(r.orig.x), static_cast<float>(r.orig.y), static_cast<float>(r.orig.z) };
+    float inv_dir[3] = {
+        static_cast<float>(1 / r.dir.x), static_cast<float>(1 / r.dir.y), static_cast<float>(1 / r.dir.z)
+    };
+    int dir_is_neg[3] = { inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0 };
+
+    bool hit_anything = false;
+    long long nodes_visited = 0;
+
+    int to_visit[bvh_stack_size];
+    int to_visit_offset = 0;
+    int current = 0;
+
+    while (true) {
+        const motion_bvh_node& node = seg.nodes[current];
+        nodes_visited++;
+
+        if (node.hit(orig, inv_dir, dir_is_neg, static_cast<float>(t_min), static_cast<float>(t_max), w)) {
+            if (node.n_primitives > 0) {
+                const hittable* const* prims = &seg.primitive_ptrs[node.primitives_offset];
+                for (int i = 0; i < node.n_primitives; i++) {
+                    if (any_hit) {
+                        if (prims[i]->occluded(r, t_min, t_max)) {
+                            hit_anything = true;
+                            break;
+                        }
+                    } else if (prims[i]->hit(r, t_min, t_max, rec)) {
+                        hit_anything = true;
+                        t_max = rec.t;
+                    }
+                }
+
+                if (to_visit_offset == 0 || (any_hit && hit_anything)) break;
+                current = to_visit[--to_visit_offset];
+            } else {
+                // visit the child on the near side of the split plane first
+                if (dir_is_neg[node.axis]) {
+                    to_visit[to_visit_offset++] = current + 1;
+                    current = node.second_child_offset;
+                } else {
+                    to_visit[to_visit_offset++] = node.second_child_offset;
+                    current = current + 1;
+                }
+            }
+        } else {
+            if (to_visit_offset == 0) break;
+            current = to_visit[--to_visit_offset];
+        }
+    }
+
+    thread_ray_stats.nodes_visited += nodes_visited;
+
+    return hit_anything;
+}
+
+/*
+ * Number of time segments for objs when none was requested.
+ * Compares each primitive's box over the whole shutter with its boxes at the
+ * two ends, splitting in time shrinks the excess area roughly by the segment count.
+ * Interpolated boxes already follow linear motion, so segments only pay for
+ * their extra memory once movers travel many times their own size.
+ */
+int choose_time_segments(const std::vector<shared_ptr<hittable>>& objs, Float time0, Float time1) {
+    if (objs.empty()) return 1;
+
+    Float ratio_sum = 0;
+    for (const auto& o : objs) {
+        aabb whole, b0, b1;
+        o->bounding_box(time0, time1, whole);
+        o->bounding_box(time0, time0, b0);
+        o->bounding_box(time1, time1, b1);
+        Float ends = 0.5 * (b0.surface_area() + b1.surface_area());
+        ratio_sum += ends > 0 ? whole.surface_area() / ends : 1;
+    }
+    Float excess = ratio_sum / objs.size() - 1;
+
+    const int max_segments = 8;
+    int n = 1;
+    while (n < max_segments && excess / n > 16) n *= 2;
+    return n;
+}
+
+/*
+ * Build a motion BVH over objs with n_segments time segments, 0 picks the count
+ * from the amount of motion. whole_tree is a tree already built over the whole
+ * shutter, it is reused when a single segment is enough.
+ */
+shared_ptr<motion_bvh> build_motion_bvh(const std::vector<shared_ptr<hittable>>& objs,
+    const shared_ptr<bvh_node>& whole_tree, Float time0, Float time1,
+    const bvh_build_params& params, int n_segments, std::ostream& log
+) {
+    if (n_segments <= 0) {
+        n_segments = choose_time_segments(objs, time0, time1);
+        log << "\tChose " << n_segments << " time segments from the amount of motion\n";
+    }
+
+    Timer t;
+    t.start();
+
+    std::vector<shared_ptr<bvh_node>> trees;
+    if (n_segments == 1) {
+        trees.push_back(whole_tree);
+    } else {
+        for (int s = 0; s < n_segments; s++) {
+            Float seg_t0 = time0 + (time1 - time0) * s / n_segments;
+            Float seg_t1 = time0 + (time1 - time0) * (s + 1) / n_segments;
+            log << "\tTime segment [" << seg_t0 << ", " << seg_t1 << "]\n";
+            trees.push_back(build_bvh(objs, seg_t0, seg_t1, params, log));
+        }
+    }
+
+    auto mbvh = make_shared<motion_bvh>(trees, time0, time1);
+    log << "\t" << n_segments << " time segments with " << mbvh->node_count() << " motion nodes ("
+        << mbvh->node_count() * sizeof(motion_bvh_node) << " bytes) in "
+        << t.elapsedMilli() << " milliseconds\n";
+
+    return mbvh;
+}
+
+#endif //MOTION_BVH_H
@@ -0,0 +1,61 @@
+#ifndef SPATIAL_SPLIT_H
+#define SPATIAL_SPLIT_H
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "aabb.hpp"
+#include "triangle.hpp"
+
+// overlap of two boxes, empty if they are disjoint
+inline aabb intersect_boxes(const aabb& a, const aabb& b) {
+    aabb o;
+    o.min = point3(fmax(a.min.x, b.min.x), fmax(a.min.y, b.min.y), fmax(a.min.z, b.min.z));
+    o.max = point3(fmin(a.max.x, b.max.x), fmin(a.max.y, b.max.y), fmin(a.max.z, b.max.z));
+    return o;
+}
+
+/*
+ * Split the part of a primitive inside box at the plane p[axis] = pos.
+ * A triangle is clipped against the plane, so left and right bound only its
+ * pieces on each side. Any other primitive, passed as a null tri, is not
+ * clipped, its box is cut at the plane, which is still conservative.
+ * Either side is empty if nothing of the primitive lies there.
+ */
+void split_primitive_box(const triangle* tri, const aabb& box, int axis, Float pos, aabb& left, aabb& right) {
+    aabb left_half = box, right_half = box;
+    left_half.max[axis] = pos;
+    right_half.min[axis] = pos;
+
+    if (!tri) {
+        left = box.min[axis] <= pos ? intersect_boxes(box, left_half) : aabb::empty();
+        right = box.max[axis] >= pos ? intersect_boxes(box, right_half) : aabb::empty();
+        return;
+    }
+
+    const point3 v[3] = { tri->mesh->p[tri->v[0]], tri->mesh->p[tri->v[1]], tri->mesh->p[tri->v[2]] };
+
+    left = aabb::empty();
+    right = aabb::empty();
+    for (int i = 0; i < 3; i++) {
+        const point3& a = v[i];
+        const point3& b = v[(i + 1) % 3];
+
+        if (a[axis] <= pos) left = surrounding_box(left, a);
+        if (a[axis] >= pos) right = surrounding_box(right, a);
+
+        // an edge crossing the plane adds its crossing point to both sides
+        if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+            Float t = (pos - a[axis]) / (b[axis] - a[axis]);
+            point3 p = a + t * (b - a);
+            p[axis] = pos;
+            left = surrounding_box(left, p);
+            right = surrounding_box(right, p);
+        }
+    }
+
+    // the reference may already have been clipped by earlier splits
+    if (!left.is_empty()) left = intersect_boxes(left, left_half);
+    if (!right.is_empty()) right = intersect_boxes(right, right_half);
+}
+
+#endif //SPATIAL_SPLIT_H
@@ -0,0 +1,444 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "bvh_node.hpp"
+#include "stats.hpp"
+#include "triangle_cluster.hpp"
+
+/*
+ * BVH node with up to N children whose bounds are stored structure of arrays,
+ * bounds_min[axis][child], so one SIMD load fetches an axis for every child.
+ * A child is either another node (child >= 0) or a leaf, encoded as the
+ * bitwise not of its index in the leaf array.
+ * Children are packed at the front, slots past n_children are unused.
+ */
+template<int N>
+struct alignas(32) wide_bvh_node {
+    float bounds_min[3][N];
+    float bounds_max[3][N];
+    int32_t child[N];
+    uint8_t n_children;
+
+    void set_child_bounds(int i, const aabb& box) {
+        bounds_min[0][i] = round_down_to_float(box.min.x);
+        bounds_min[1][i] = round_down_to_float(box.min.y);
+        bounds_min[2][i] = round_down_to_float(box.min.z);
+        bounds_max[0][i] = round_up_to_float(box.max.x);
+        bounds_max[1][i] = round_up_to_float(box.max.y);
+        bounds_max[2][i] = round_up_to_float(box.max.z);
+    }
+};
+
+// ray data converted once per traversal, inv_dir never holds inf so no slab produces a NaN
+struct wide_bvh_ray {
+    float orig[3];
+    float inv_dir[3];
+
+    wide_bvh_ray(const ray& r) {
+        const float big = std::numeric_limits<float>::max();
+        for (int a = 0; a < 3; a++) {
+            orig[a] = static_cast<float>(r.orig[a]);
+            float inv = static_cast<float>(1 / r.dir[a]);
+            inv_dir[a] = std::isfinite(inv) ? inv : std::copysign(big, inv);
+        }
+    }
+};
+
+// widen the far distance to account for float rounding in the subtraction and product
+const float wide_bvh_widen = 1 + 2 * 3 * std::numeric_limits<float>::epsilon();
+
+/*
+ * Test a ray against every child box of a node, returns a bit mask of the
+ * children hit and writes their entry distances to t_near.
+ * The generic version is plain scalar code, 4 and 8 wide nodes use SSE/AVX.
+ */
+template<int N>
+inline int intersect_children(const wide_bvh_node<N>& node, const wide_bvh_ray& wr,
+        float t_min, float t_max, float t_near[N]) {
+    int mask = 0;
+    for (int i = 0; i < node.n_children; i++) {
+        float t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; a++) {
+            float s0 = (node.bounds_min[a][i] - wr.orig[a]) * wr.inv_dir[a];
+            float s1 = (node.bounds_max[a][i] - wr.orig[a]) * wr.inv_dir[a];
+            t0 = std::max(t0, std::min(s0, s1));
+            t1 = std::min(t1, std::max(s0, s1) * wide_bvh_widen);
+        }
+        t_near[i] = t0;
+        if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#if defined(__SSE2__)
+template<>
+inline int intersect_children<4>(const wide_bvh_node<4>& node, const wide_bvh_ray& wr,
+        float t_min, float t_max, float t_near[4]) {
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    const __m128 widen = _mm_set1_ps(wide_bvh_widen);
+
+    for (int a = 0; a < 3; a++) {
+        __m128 o = _mm_set1_ps(wr.orig[a]);
+        __m128 inv = _mm_set1_ps(wr.inv_dir[a]);
+        __m128 s0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_min[a]), o), inv);
+        __m128 s1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_max[a]), o), inv);
+        t0 = _mm_max_ps(t0, _mm_min_ps(s0, s1));
+        t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_max_ps(s0, s1), widen));
+    }
+
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.n_children) - 1);
+}
+#endif
+
+#if defined(__AVX__)
+template<>
+inline int intersect_children<8>(const wide_bvh_node<8>& node, const wide_bvh_ray& wr,
+        float t_min, float t_max, float t_near[8]) {
+    __m256 t0 = _mm256_set1_ps(t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    const __m256 widen = _mm256_set1_ps(wide_bvh_widen);
+
+    for (int a = 0; a < 3; a++) {
+        __m256 o = _mm256_set1_ps(wr.orig[a]);
+        __m256 inv = _mm256_set1_ps(wr.inv_dir[a]);
+        __m256 s0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds_min[a]), o), inv);
+        __m256 s1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds_max[a]), o), inv);
+        t0 = _mm256_max_ps(t0, _mm256_min_ps(s0, s1));
+        t1 = _mm256_min_ps(t1, _mm256_mul_ps(_mm256_max_ps(s0, s1), widen));
+    }
+
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & ((1 << node.n_children) - 1);
+}
+#endif
+
+/*
+ * Nodes of a wide_bvh as traverse() sees them,
+ * other node layouts of the same tree provide the same two members
+ */
+template<int N>
+struct wide_bvh_node_set {
+    const std::vector<wide_bvh_node<N>>& nodes;
+
+    bool empty() const { return nodes.empty(); }
+
+    // test the children of a node, child is pointed at the indices of its children
+    int intersect(int32_t index, const wide_bvh_ray& wr, float t_min, float t_max, float t_near[N],
+            const int32_t*& child) const {
+        const wide_bvh_node<N>& node = nodes[index];
+        child = node.child;
+        return intersect_children<N>(node, wr, t_min, t_max, t_near);
+    }
+};
+
+// a leaf holds triangles baked into clusters followed by any other primitives
+struct wide_bvh_leaf {
+    int32_t cluster_offset;
+    int32_t primitive_offset;
+    uint16_t n_clusters;
+    uint16_t n_primitives;
+};
+
+/*
+ * N-ary BVH made by collapsing a binary bvh_node tree.
+ * Each node adopts the grandchildren of its largest interior children
+ * until it has N children. Subtrees with at most one cluster worth of
+ * primitives become a single leaf, and the triangles in a leaf are baked
+ * into clusters of cluster_width that are tested with one SIMD kernel.
+ */
+template<int N>
+class wide_bvh : public hittable {
+    public:
+        static constexpr int cluster_width = N >= 8 ? 8 : 4;
+
+        std::vector<wide_bvh_node<N>> nodes;
+        std::vector<wide_bvh_leaf> leaves;
+        std::vector<triangle_cluster<cluster_width>> clusters;
+
+        // owning references to every primitive in leaf order, and raw pointers
+        // to the ones that are not clustered, used while traversing
+        std::vector<shared_ptr<hittable>> primitives;
+        std::vector<const hittable*> primitive_ptrs;
+
+        aabb box;
+
+        // with bake_triangles false every primitive goes through its virtual hit()
+        wide_bvh(const bvh_node& root, Float time0, Float time1, bool bake_triangles = true);
+
+        virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
+        virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override;
+
+    protected:
+        // stack traversal, shared with layouts that store the same tree in another node format.
+        // With any_hit true it returns at the first hit found and rec is left alone
+        template<bool any_hit, typename NodeSet>
+        bool traverse(const NodeSet& node_set, const ray& r, Float t_min, Float t_max, hit_record& rec) const;
+
+    private:
+        Float time0, time1;
+        bool bake_triangles;
+
+        bool is_interior(const shared_ptr<hittable>& h) const;
+
+        aabb child_box(const shared_ptr<hittable>& h) const;
+
+        static void gather_primitives(const shared_ptr<hittable>& h, std::vector<shared_ptr<hittable>>& out);
+
+        int make_leaf(const shared_ptr<hittable>& h);
+
+        int collapse(const bvh_node& node);
+};
+
+template<int N>
+wide_bvh<N>::wide_bvh(const bvh_node& root, Float time0, Float time1, bool bake_triangles)
+: box{ root.box }, time0{ time0 }, time1{ time1 }, bake_triangles{ bake_triangles } {
+    static_assert(N >= 2 && N <= 8, "wide_bvh supports 2 to 8 children per node");
+
+    collapse(root);
+}
+
+template<int N>
+bool wide_bvh<N>::bounding_box(Float, Float, aabb& output_box) const {
+    output_box = box;
+    return true;
+}
+
+/*
+ * Interior for collapsing purposes. Median builder leaves have primitives as
+ * both children, and small subtrees are flattened into one leaf.
+ */
+template<int N>
+bool wide_bvh<N>::is_interior(const shared_ptr<hittable>& h) const {
+    auto node = std::dynamic_pointer_cast<bvh_node>(h);
+    if (!node || node->is_leaf()) return false;
+    if (node->n_primitives <= cluster_width) return false;
+    return std::dynamic_pointer_cast<bvh_node>(node->left) || std::dynamic_pointer_cast<bvh_node>(node->right);
+}
+
+template<int N>
+void wide_bvh<N>::gather_primitives(const shared_ptr<hittable>& h, std::vector<shared_ptr<hittable>>& out) {
+    auto node = std::dynamic_pointer_cast<bvh_node>(h);
+    if (!node) {
+        out.push_back(h);
+    } else if (node->is_leaf()) {
+        for (const auto& o : node->objects) out.push_back(o);
+    } else {
+        gather_primitives(node->left, out);
+        if (node->right != node->left) gather_primitives(node->right, out);
+    }
+}
+
+template<int N>
+int wide_bvh<N>::make_leaf(const shared_ptr<hittable>& h) {
+    std::vector<shared_ptr<hittable>> prims;
+    gather_primitives(h, prims);
+
+    wide_bvh_leaf leaf;
+    leaf.cluster_offset = clusters.size();
+    leaf.primitive_offset = primitive_ptrs.size();
+
+    std::vector<const triangle*> tris;
+    for (const auto& p : prims) {
+        primitives.push_back(p);
+        const triangle* tri = bake_triangles ? dynamic_cast<const triangle*>(p.get()) : nullptr;
+        if (tri)
+            tris.push_back(tri);
+        else
+            primitive_ptrs.push_back(p.get());
+    }
+
+    for (size_t i = 0; i < tris.size(); i += cluster_width) {
+        int n = std::min<int>(cluster_width, tris.size() - i);
+        clusters.emplace_back(&tris[i], n);
+    }
+
+    leaf.n_clusters = clusters.size() - leaf.cluster_offset;
+    leaf.n_primitives = primitive_ptrs.size() - leaf.primitive_offset;
+
+    leaves.push_back(leaf);
+    return leaves.size() - 1;
+}
+
+template<int N>
+aabb wide_bvh<N>::child_box(const shared_ptr<hittable>& h) const {
+    aabb b;
+    h->bounding_box(time0, time1, b);
+    return b;
+}
+
+template<int N>
+int wide_bvh<N>::collapse(const bvh_node& node) {
+    std::vector<shared_ptr<hittable>> children;
+
+    if (node.is_leaf()) {
+        // only reached for a root that is a single leaf
+        children.push_back(make_shared<bvh_node>(node));
+    } else {
+        children.push_back(node.left);
+        if (node.right != node.left) children.push_back(node.right);
+    }
+
+    // open the interior child with the largest surface area until the node is full
+    while (static_cast<int>(children.size()) < N) {
+        int best = -1;
+        Float best_area = -1;
+        for (size_t i = 0; i < children.size(); i++) {
+            if (!is_interior(children[i])) continue;
+            Float area = child_box(children[i]).surface_area();
+            if (area > best_area) {
+                best_area = area;
+                best = i;
+            }
+        }
+        if (best < 0) break;
+
+        auto opened = std::static_pointer_cast<bvh_node>(children[best]);
+        children[best] = opened->left;
+        if (opened->right != opened->left) children.push_back(opened->right);
+    }
+
+    int offset = nodes.size();
+    nodes.emplace_back();
+    {
+        wide_bvh_node<N>& n = nodes[offset];
+        n.n_children = children.size();
+        for (int i = 0; i < N; i++) {
+            n.set_child_bounds(i, aabb(point3(0), point3(0)));
+            n.child[i] = 0;
+        }
+    }
+
+    for (size_t i = 0; i < children.size(); i++) {
+        const auto& c = children[i];
+        aabb cbox = child_box(c);
+
+        int32_t child;
+        if (is_interior(c))
+            child = collapse(*std::static_pointer_cast<bvh_node>(c));
+        else
+            child = ~static_cast<int32_t>(make_leaf(c));
+
+        // nodes may have been reallocated by the recursion
+        wide_bvh_node<N>& n = nodes[offset];
+        n.set_child_bounds(i, cbox);
+        n.child[i] = child;
+    }
+
+    return offset;
+}
+
+template<int N>
+bool wide_bvh<N>::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    return traverse<false>(wide_bvh_node_set<N>{ nodes }, r, t_min, t_max, rec);
+}
+
+template<int N>
+bool wide_bvh<N>::occluded(const ray& r, Float t_min, Float t_max) const {
+    hit_record unused;
+    return traverse<true>(wide_bvh_node_set<N>{ nodes }, r, t_min, t_max, unused);
+}
+
+template<int N>
+template<bool any_hit, typename NodeSet>
+bool wide_bvh<N>::traverse(const NodeSet& node_set, const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    if (node_set.empty()) return false;
+
+    struct stack_entry {
+        int32_t child;
+        float t_near;
+    };
+
+    wide_bvh_ray wr(r);
+    cluster_ray cr(r);
+    bool hit_anything = false;
+    long long nodes_visited = 0;
+
+    // closest clustered triangle, only filled into rec once traversal is done
+    cluster_hit best = { nullptr, 0, 0, 0 };
+
+    stack_entry stack[bvh_stack_size * N];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, static_cast<float>(t_min) };
+
+    while (stack_size > 0) {
+        stack_entry e = stack[--stack_size];
+
+        // the current hit may be closer than this entry was when it was pushed
+        if (e.t_near > t_max) continue;
+
+        if (e.child < 0) {
+            const wide_bvh_leaf& leaf = leaves[~e.child];
+
+            const triangle_cluster<cluster_width>* cl = &clusters[leaf.cluster_offset];
+            for (int i = 0; i < leaf.n_clusters; i++) {
+                if (cl[i].intersect(cr, static_cast<float>(t_min), static_cast<float>(t_max), best)) {
+                    hit_anything = true;
+                    t_max = best.t;
+                    if (any_hit) break;
+                }
+            }
+
+            const hittable* const* prims = &primitive_ptrs[leaf.primitive_offset];
+            for (int i = 0; i < leaf.n_primitives && !(any_hit && hit_anything); i++) {
+                if (any_hit) {
+                    hit_anything = prims[i]->occluded(r, t_min, t_max);
+                } else if (prims[i]->hit(r, t_min, t_max, rec)) {
+                    hit_anything = true;
+                    t_max = rec.t;
+                    // rec now holds a hit closer than any clustered triangle so far
+                    best.tri = nullptr;
+                }
+            }
+
+            if (any_hit && hit_anything) break;
+            continue;
+        }
+
+        nodes_visited++;
+
+        float t_near[N];
+        const int32_t* child;
+        int mask = node_set.intersect(e.child, wr, static_cast<float>(t_min), static_cast<float>(t_max), t_near, child);
+
+        // gather the children hit and push them far to near so the nearest is popped first
+        stack_entry hits[N];
+        int n_hits = 0;
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            stack_entry h = { child[i], t_near[i] };
+            int j = n_hits++;
+            while (j > 0 && hits[j - 1].t_near < h.t_near) {
+                hits[j] = hits[j - 1];
+                j--;
+            }
+            hits[j] = h;
+        }
+        for (int i = 0; i < n_hits; i++) stack[stack_size++] = hits[i];
+    }
+
+    thread_ray_stats.nodes_visited += nodes_visited;
+
+    if (!any_hit && best.tri)
+        best.tri->fill_hit_record(r, best.t, best.u, best.v, rec);
+
+    return hit_anything;
+}
+
+#endif //WIDE_BVH_H
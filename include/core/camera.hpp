@@ -2,6 +2,7 @@
 #define CAMERA_H
 
 #include "utility.hpp"
+#include "sampler.hpp"
 
 class camera {
     public:
@@ -45,9 +46,9 @@ class camera {
             this->time1 = time1;
         }
 
-        ray get_ray(Float u, Float v) const {
+        ray get_ray(Float u, Float v, sampler& rng) const {
             // circular aperture
-            //vec3 rd = lens_radius * random_in_unit_disk();
+            //vec3 rd = lens_radius * rng.in_unit_disk();
 
             //triangular aperture
             point3 p0(1,0.5,0);
@@ -58,10 +59,10 @@ class camera {
             p1 *= lens_radius;
             p2 *= lens_radius;
 
-            vec3 rd = random_in_triangle(p0, p1, p2);
+            vec3 rd = rng.in_triangle(p0, p1, p2);
 
             //half of the time, flip the y axis to build the star of david
-            if (random_Float() > 0.5) {
+            if (rng.uniform() > 0.5) {
                 rd.y = -rd.y;
             }
 
@@ -70,7 +71,7 @@ class camera {
             return ray(
                 origin + offset, 
                 lower_left_corner + u * horizontal + v * vertical - origin - offset,
-                random_Float(time0, time1)
+                rng.uniform(time0, time1)
             );
         }
 };
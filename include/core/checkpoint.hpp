@@ -0,0 +1,128 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "utility.hpp"
+#include "film.hpp"
+#include "options.hpp"
+#include "threading.hpp"
+#include "bvh_cache.hpp"
+
+/*
+ * Everything the image depends on: the scene, the bytes of the .obj file it reads,
+ * the image size and the sampling settings. Traversal structures and thread counts
+ * are left out, they change how fast the image is rendered, not the image.
+ * A checkpoint only resumes into a render with the same key.
+ */
+uint64_t checkpoint_key(const render_options& opts, const render_settings& rs) {
+    uint64_t h = fnv1a_value(static_cast<int>(opts.scene), 14695981039346656037ull);
+
+    if (opts.scene == scene_type::obj || opts.scene == scene_type::instances) {
+        auto f = mapped_file::open(opts.obj_file);
+        if (f) h = fnv1a(f->data, f->size, h);
+        h = fnv1a_value(opts.n_instances, h);
+        h = fnv1a_value(opts.frames, h);
+    }
+
+    h = fnv1a_value(rs.image_width, h);
+    h = fnv1a_value(rs.image_height, h);
+    h = fnv1a_value(rs.MSAA_samples_per_pixel, h);
+    h = fnv1a_value(rs.max_depth, h);
+    h = fnv1a_value(sizeof(Float), h);
+    return h;
+}
+
+/*
+ * File layout
+ *   header
+ *   film state    color sums, squared luminance sums and sample counts of every pixel
+ * Checkpoints are written between passes, when every tile of the pass is done,
+ * so the sample counts are the whole completion state: a resumed render goes on
+ * with the next pass and every pixel continues its own sample sequence.
+ */
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t float_size;
+    uint64_t key;
+
+    int32_t width, height;
+    int32_t passes;
+    int32_t reserved;
+};
+
+const char checkpoint_magic[8] = { 'R', 'T', 'C', 'K', 'P', 'T', '\0', '\0' };
+const uint32_t checkpoint_version = 1;
+
+/*
+ * Write image after passes passes to path. The file is written next to it first and
+ * renamed over it, so a crash while writing leaves the previous checkpoint intact.
+ */
+bool write_checkpoint(const std::string& path, uint64_t key, const film& image, int passes) {
+    checkpoint_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, checkpoint_magic, sizeof(checkpoint_magic));
+    h.version = checkpoint_version;
+    h.float_size = sizeof(Float);
+    h.key = key;
+    h.width = image.width;
+    h.height = image.height;
+    h.passes = passes;
+
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out) return false;
+
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    image.write_state(out);
+
+    out.close();
+    if (!out) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+/*
+ * Load the checkpoint at path into image, an empty film, and set passes to the passes
+ * it holds. Returns false with the reason in err if the file is missing, truncated
+ * or belongs to another render.
+ */
+bool read_checkpoint(const std::string& path, uint64_t key, film& image, int& passes, std::ostream& err) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        err << "Could not open checkpoint " << path << "\n";
+        return false;
+    }
+
+    checkpoint_header h;
+    if (!in.read(reinterpret_cast<char*>(&h), sizeof(h))
+        || std::memcmp(h.magic, checkpoint_magic, sizeof(checkpoint_magic)) != 0
+        || h.version != checkpoint_version || h.float_size != sizeof(Float)) {
+        err << path << " is no checkpoint of this version\n";
+        return false;
+    }
+
+    if (h.key != key || h.width != image.width || h.height != image.height) {
+        err << path << " was rendered with another scene, image size or sampling settings\n";
+        return false;
+    }
+
+    if (!image.read_state(in)) {
+        err << path << " is truncated\n";
+        return false;
+    }
+
+    passes = h.passes;
+    return true;
+}
+
+#endif //CHECKPOINT_H
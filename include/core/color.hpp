@@ -2,36 +2,73 @@
 #define COLOR_H
 
 #include <iostream>
-#include <queue>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
 
 #include "utility.hpp"
 #include "hittable.hpp"
 #include "material.hpp"
+#include "stats.hpp"
 
-color ray_color(const ray& r, const hittable& world, int depth) {
+// min time is 0.0001 to get rid of shadow acne
+const Float ray_t_min = 0.0001;
+
+color ray_color(const ray& r, const hittable& world, int depth, sampler& rng);
+
+// color seen by a ray that leaves the scene
+color background_color(const ray& r) {
+    //return color(0.0);
+
+    vec3 unit_dir = unit_vector(r.dir);
+    Float t = 0.5 * (unit_dir.y + 1);
+    return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+}
+
+// light leaving the surface hit in rec towards the origin of r
+color shade_hit(const ray& r, const hit_record& rec, const hittable& world, int depth, sampler& rng) {
+    ray scattered;
+    color attenuation;
+    color emitted = rec.mat_ptr->emitted();
+
+    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered, rng))
+        return emitted;
+
+    return emitted + attenuation * ray_color(scattered, world, depth-1, rng);
+}
+
+color ray_color(const ray& r, const hittable& world, int depth, sampler& rng) {
     hit_record rec;
 
     if (depth <= 0)
         return color(0,0,0);
 
-    // min time is 0.0001 to get rid of shadow acne
-    if (world.hit(r, 0.0001, infinity, rec)) {
-        ray scattered;
-        color attenuation;
-        color emitted = rec.mat_ptr->emitted();
+    thread_ray_stats.rays++;
+
+    if (world.hit(r, ray_t_min, infinity, rec))
+        return shade_hit(r, rec, world, depth, rng);
+
+    return background_color(r);
+}
 
-        if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            return emitted;
-            
-        return emitted + attenuation * ray_color(scattered, world, depth-1);
+/*
+ * Colors of the camera rays in packet, written to out.
+ * The packet is only traced together to the first hit,
+ * bounces go in all directions so every lane continues on its own.
+ */
+void ray_color_packet(ray_packet& packet, const hittable& world, int depth, color out[], sampler& rng) {
+    if (depth <= 0) {
+        for (int i = 0; i < packet.size; i++) out[i] = color(0,0,0);
+        return;
     }
 
-    //background color
-    //return color(0.0);
+    thread_ray_stats.rays += packet.size;
 
-    vec3 unit_dir = unit_vector(r.dir);
-    Float t = 0.5 * (unit_dir.y + 1);
-    return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+    hit_record recs[ray_packet::max_size];
+    world.hit_packet(packet, ray_t_min, recs);
+
+    for (int i = 0; i < packet.size; i++)
+        out[i] = packet.hit[i] ? shade_hit(packet.rays[i], recs[i], world, depth, rng) : background_color(packet.rays[i]);
 }
 
 // https://knarkowicz.wordpress.com/2016/01/06/aces-filmic-tone-mapping-curve/
@@ -82,27 +119,93 @@ void write_color(std::ostream &out, const color& pixel_color,
         << static_cast<int>(256 * clamp(new_col.z, 0, 0.9999)) << '\n';
 }
 
-std::queue<int*> buildPixelBlocks(int image_width, int image_height, 
-        int horizontal_pixel_blocks, int vertical_pixel_blocks) {
-    std::queue<int*> q;
-    int *width_indexes = new int[horizontal_pixel_blocks + 1];
-    int *height_indexes = new int[vertical_pixel_blocks + 1];
+// block of pixels [x0, x1) x [y0, y1) rendered as one unit of work
+struct pixel_tile {
+    int x0, x1;
+    int y0, y1;
+};
 
-    for (int i = 0; i < horizontal_pixel_blocks + 1; i++) {
-        width_indexes[i] = i * image_width / horizontal_pixel_blocks;
-    } 
+// order tiles are handed to the render threads in
+enum class tile_order { hilbert, morton, rows };
 
-    for (int j = 0; j < vertical_pixel_blocks + 1; j++) {
-        height_indexes[j] = j * image_height / vertical_pixel_blocks;
+const char* tile_order_name(tile_order order) {
+    switch (order) {
+        case tile_order::hilbert: return "hilbert";
+        case tile_order::morton: return "morton";
+        default: return "rows";
     }
+}
 
-    for (int i = 0; i < horizontal_pixel_blocks; i++) {
-        for (int j = 0; j < vertical_pixel_blocks; j++) {
-            int *arr = new int[4] {width_indexes[i],width_indexes[i + 1],height_indexes[j],height_indexes[j + 1]};
-            q.push(arr);
+// position of (x, y) along the Hilbert curve through an n by n grid, n a power of two
+uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+
+        // rotate the quadrant so the curve continues where the previous one ended
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
         }
     }
-    return q;
+    return d;
+}
+
+// position of (x, y) along the Morton (Z order) curve, the bits of x and y interleaved
+uint64_t morton_index(uint32_t x, uint32_t y) {
+    auto spread = [](uint64_t v) {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+/*
+ * The image split into square tiles of tile_size pixels, the last row and column
+ * are cut off at the image border. Along a Hilbert or Morton curve consecutive tiles
+ * are neighbours, so a thread taking the next tile finds much of the BVH it needs
+ * still in cache. On grids that are no power of two the curve of the enclosing
+ * power of two grid is followed, skipping the cells outside the image.
+ */
+std::vector<pixel_tile> buildPixelBlocks(int image_width, int image_height, int tile_size, tile_order order) {
+    const int nx = (image_width + tile_size - 1) / tile_size;
+    const int ny = (image_height + tile_size - 1) / tile_size;
+
+    uint32_t n = 1;
+    while (n < static_cast<uint32_t>(std::max(nx, ny))) n *= 2;
+
+    std::vector<std::pair<uint64_t, pixel_tile>> keyed;
+    keyed.reserve(nx * ny);
+    for (int y = 0; y < ny; y++) {
+        for (int x = 0; x < nx; x++) {
+            uint64_t key;
+            if (order == tile_order::hilbert) key = hilbert_index(n, x, y);
+            else if (order == tile_order::morton) key = morton_index(x, y);
+            else key = static_cast<uint64_t>(y) * nx + x;
+
+            keyed.push_back({ key, {
+                x * tile_size, std::min((x + 1) * tile_size, image_width),
+                y * tile_size, std::min((y + 1) * tile_size, image_height)
+            }});
+        }
+    }
+
+    std::sort(keyed.begin(), keyed.end(),
+        [](const std::pair<uint64_t, pixel_tile>& a, const std::pair<uint64_t, pixel_tile>& b) { return a.first < b.first; });
+
+    std::vector<pixel_tile> tiles;
+    tiles.reserve(keyed.size());
+    for (const auto& k : keyed) tiles.push_back(k.second);
+    return tiles;
 }
 
 void write_image(std::ostream& out, color *pixels, int image_width, int image_height,
@@ -111,7 +214,7 @@ void write_image(std::ostream& out, color *pixels, int image_width, int image_he
 
     for (int j = image_height - 1; j >= 0; j--) {
         for (int i = 0; i < image_width; i++) {
-            write_color(std::cout, pixels[j * image_width + i], MSAA_samples_per_pixel, MC_samples_per_pixel);
+            write_color(out, pixels[j * image_width + i], MSAA_samples_per_pixel, MC_samples_per_pixel);
         }
     }
 
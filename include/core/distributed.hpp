@@ -0,0 +1,507 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "camera.hpp"
+#include "color.hpp"
+#include "film.hpp"
+#include "stats.hpp"
+#include "threading.hpp"
+
+/*
+ * Distributed rendering over TCP.
+ * A coordinator splits the image into tiles and hands them out in jobs to worker
+ * processes, started locally by the coordinator or by hand on other machines.
+ * Workers build the scene from the same command line, render their jobs with
+ * render_pass and send every tile back as the HDR sums of its pixels, which the
+ * coordinator merges into its film. When the connection to a worker drops, or a
+ * message from it stalls halfway, its unfinished tiles go back to the queue for the others.
+ *
+ * Messages are plain structs in host byte order and layout, so every machine
+ * must run the same build. A message starts with one of the message_type bytes:
+ *   worker -> coordinator: worker_hello once, then result per rendered tile
+ *   coordinator -> worker: job with a tile count and the tiles, or quit
+ */
+
+enum message_type : uint8_t { msg_job = 'J', msg_result = 'R', msg_quit = 'Q' };
+
+// "RTWK", also tells apart a worker from anything else connecting to the port
+const uint32_t worker_magic = 0x4B575452;
+
+struct worker_hello {
+    uint32_t magic;
+    int32_t image_width;
+    int32_t image_height;
+    int32_t samples;
+    int32_t n_threads;
+};
+
+// sent before the pixels of a tile, stats are the rays the worker traced since its last result
+struct tile_result {
+    pixel_tile tile;
+    ray_stats stats;
+};
+
+struct tile_pixel {
+    Float sum[3];
+    Float sum_sq;
+    int32_t samples;
+};
+
+bool send_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool recv_all(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/*
+ * Seconds a message from a connection may stall before the coordinator gives up on it.
+ * The coordinator only reads once poll says data arrived, so this bounds how long a peer
+ * that sends part of a message, such as a port scanner or a hung worker, holds up the render.
+ */
+const int coordinator_recv_timeout = 10;
+
+// recv on fd fails once no data came for seconds
+void set_recv_timeout(int fd, int seconds) {
+    timeval tv = { seconds, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * Probe an idle connection after 10 seconds, every 5 seconds, and give up after 3
+ * probes without an answer, so a worker whose machine vanished without closing
+ * the connection shows up as a socket error within half a minute.
+ */
+void enable_keepalive(int fd) {
+    int one = 1, idle = 10, interval = 5, count = 3;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+/*
+ * A worker that is still connected but sends no result is hung once its job has run
+ * job_deadline_factor times as long as jobs take on average, and never before
+ * job_deadline_min seconds. Until the first job is done there is no average to go by.
+ */
+const Float job_deadline_factor = 10;
+const Float job_deadline_min = 30;
+
+// connected socket to address, given as host:port, or -1
+int connect_to(const std::string& address, std::ostream& err) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        err << "Address \"" << address << "\" is not host:port\n";
+        return -1;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+        err << "Could not resolve " << address << "\n";
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* a = found; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+
+    if (fd < 0) {
+        err << "Could not connect to " << address << "\n";
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * Worker side: connect to the coordinator at address and render the jobs it sends
+ * with n_threads threads until it says quit. Returns false if the connection
+ * could not be made or broke before the coordinator was done.
+ */
+bool run_worker(const std::string& address, const hittable& world, const camera& cam,
+        const render_settings& rs, int n_samples, int n_threads, std::ostream& log) {
+    int fd = connect_to(address, log);
+    if (fd < 0) return false;
+
+    worker_hello hello = { worker_magic, rs.image_width, rs.image_height, n_samples, n_threads };
+    if (!send_all(fd, &hello, sizeof(hello))) {
+        log << "\tError: lost the coordinator before starting\n";
+        close(fd);
+        return false;
+    }
+    log << "\tConnected to " << address << "\n" << std::flush;
+
+    film image(rs.image_width, rs.image_height);
+    std::ostream quiet(nullptr);
+    ray_stats reported;
+    int n_jobs = 0, n_tiles = 0;
+    bool ok = false;
+
+    while (true) {
+        uint8_t type;
+        if (!recv_all(fd, &type, 1)) break;
+        if (type == msg_quit) {
+            ok = true;
+            break;
+        }
+
+        int32_t count;
+        if (type != msg_job || !recv_all(fd, &count, sizeof(count)) || count <= 0) break;
+        std::vector<pixel_tile> job(count);
+        if (!recv_all(fd, job.data(), count * sizeof(pixel_tile))) break;
+
+        tile_scheduler tiles(job);
+        render_pass(tiles, image, world, cam, rs, n_samples, nullptr, nullptr, n_threads, quiet);
+
+        bool sent = true;
+        for (const pixel_tile& t : job) {
+            tile_result result = { t, ray_stats() };
+            if (&t == &job.front()) {
+                // the rays of the whole job travel with its first tile
+                result.stats = total_ray_stats;
+                result.stats.rays -= reported.rays;
+                result.stats.nodes_visited -= reported.nodes_visited;
+                result.stats.primitive_tests -= reported.primitive_tests;
+                reported = total_ray_stats;
+            }
+
+            std::vector<tile_pixel> pixels;
+            pixels.reserve((t.x1 - t.x0) * (t.y1 - t.y0));
+            for (int j = t.y0; j < t.y1; j++) {
+                for (int i = t.x0; i < t.x1; i++) {
+                    int p = j * rs.image_width + i;
+                    const color& s = image.pixel_sum(p);
+                    pixels.push_back({ { s.x, s.y, s.z }, image.pixel_sum_sq(p), image.sample_count(p) });
+                }
+            }
+
+            uint8_t result_type = msg_result;
+            sent = send_all(fd, &result_type, 1) && send_all(fd, &result, sizeof(result))
+                && send_all(fd, pixels.data(), pixels.size() * sizeof(tile_pixel));
+            if (!sent) break;
+        }
+        if (!sent) break;
+
+        n_jobs++;
+        n_tiles += count;
+    }
+
+    close(fd);
+    log << "\tRendered " << n_tiles << " tiles in " << n_jobs << " jobs\n";
+    if (!ok) log << "\tError: lost the coordinator\n";
+    return ok;
+}
+
+/*
+ * Coordinator side: render n_samples per pixel of every tile into image on workers.
+ * Listens on port, 0 picks a free one, for workers on other machines and starts
+ * local_workers processes of this program with worker_args, the program name
+ * first, pointed at the port and logging to log_file.worker<i>.
+ * Every worker gets two tiles per thread at a time, merged tiles are queued on
+ * stream if given. A worker that disconnects, stops answering keepalive probes or
+ * sends no result before the job deadline is dropped and its tiles handed to the
+ * others. Returns false if the port cannot be opened or every local
+ * worker was lost with tiles left and no other worker connected.
+ */
+bool run_coordinator(int port, const std::vector<pixel_tile>& tiles, film& image, int n_samples,
+        int local_workers, const std::vector<std::string>& worker_args, const std::string& log_file,
+        std::ostream& progress, std::ostream& log, tile_stream_writer* stream = nullptr) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    socklen_t addr_len = sizeof(addr);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+            || listen(listen_fd, 64) != 0 || getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0) {
+        log << "\tError: could not listen on port " << port << "\n";
+        if (listen_fd >= 0) close(listen_fd);
+        return false;
+    }
+    port = ntohs(addr.sin_port);
+    log << "\tListening for workers on port " << port << "\n" << std::flush;
+
+    // local workers run this program again, /proc/self/exe finds it whatever the working directory.
+    // Their arguments are built before forking, threads such as the stream writer may be running,
+    // so the child must not allocate and only calls execv
+    std::vector<std::vector<std::string>> args(local_workers, worker_args);
+    std::vector<std::vector<char*>> argvs(local_workers);
+    for (int w = 0; w < local_workers; w++) {
+        args[w].push_back("--worker=127.0.0.1:" + std::to_string(port));
+        args[w].push_back("--log=" + log_file + ".worker" + std::to_string(w));
+        for (auto& a : args[w]) argvs[w].push_back(a.data());
+        argvs[w].push_back(nullptr);
+    }
+
+    std::vector<pid_t> children;
+    for (int w = 0; w < local_workers; w++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execv("/proc/self/exe", argvs[w].data());
+            _exit(127);
+        }
+        if (pid > 0) children.push_back(pid);
+        else log << "\tError: could not start local worker " << w << "\n";
+    }
+    log << "\tStarted " << children.size() << " local workers\n" << std::flush;
+
+    struct worker_connection {
+        int fd;
+        int id;
+        int job_size;
+        std::vector<pixel_tile> tiles;
+        int tiles_done;
+        std::chrono::steady_clock::time_point job_start;
+    };
+    std::vector<worker_connection> workers;
+
+    // accepted connections that have not sent all of their worker_hello yet
+    struct greeting {
+        int fd;
+        std::chrono::steady_clock::time_point since;
+        worker_hello hello;
+        size_t received;
+    };
+    std::vector<greeting> greetings;
+    std::deque<pixel_tile> pending(tiles.begin(), tiles.end());
+    size_t n_done = 0;
+    Float mean_job_seconds = 0;
+    int n_jobs_done = 0;
+    int n_connected = 0;
+    int n_lost = 0;
+    bool ok = true;
+
+    // unfinished tiles of a lost worker go to the front, so they are not the last ones rendered
+    auto drop = [&](size_t w, const char* reason) {
+        worker_connection& c = workers[w];
+        log << "\t\tWorker " << c.id << " " << reason << " after " << c.tiles_done << " tiles, "
+            << c.tiles.size() << " tiles handed out again\n" << std::flush;
+        pending.insert(pending.begin(), c.tiles.begin(), c.tiles.end());
+        close(c.fd);
+        workers.erase(workers.begin() + w);
+        n_lost++;
+    };
+
+    auto local_workers_running = [&]() {
+        for (pid_t& pid : children) {
+            if (pid > 0 && waitpid(pid, nullptr, WNOHANG) == pid) pid = 0;
+        }
+        for (pid_t pid : children)
+            if (pid > 0) return true;
+        return false;
+    };
+
+    while (n_done < tiles.size()) {
+        for (size_t w = 0; w < workers.size(); w++) {
+            worker_connection& c = workers[w];
+            if (!c.tiles.empty() || pending.empty()) continue;
+
+            int32_t count = std::min<size_t>(c.job_size, pending.size());
+            c.tiles.assign(pending.begin(), pending.begin() + count);
+            pending.erase(pending.begin(), pending.begin() + count);
+            c.job_start = std::chrono::steady_clock::now();
+
+            uint8_t type = msg_job;
+            if (!send_all(c.fd, &type, 1) || !send_all(c.fd, &count, sizeof(count))
+                    || !send_all(c.fd, c.tiles.data(), count * sizeof(pixel_tile))) {
+                drop(w--, "could not be sent a job");
+            }
+        }
+
+        if (n_jobs_done > 0) {
+            Float deadline = std::max(job_deadline_min, job_deadline_factor * mean_job_seconds);
+            auto now = std::chrono::steady_clock::now();
+            for (size_t w = workers.size(); w-- > 0;) {
+                const worker_connection& c = workers[w];
+                if (!c.tiles.empty() && std::chrono::duration<Float>(now - c.job_start).count() > deadline)
+                    drop(w, "sent no result in time");
+            }
+        }
+
+        if (workers.empty() && local_workers > 0 && !local_workers_running()) {
+            log << "\tError: every local worker exited with " << tiles.size() - n_done << " tiles left\n";
+            ok = false;
+            break;
+        }
+
+        std::vector<pollfd> fds = { { listen_fd, POLLIN, 0 } };
+        for (const auto& c : workers) fds.push_back({ c.fd, POLLIN, 0 });
+        for (const auto& g : greetings) fds.push_back({ g.fd, POLLIN, 0 });
+        const size_t first_greeting = 1 + workers.size();
+        if (poll(fds.data(), fds.size(), 100) < 0) continue;
+
+        // results first, fds[w + 1] belongs to workers[w] until one is dropped
+        for (size_t w = workers.size(); w-- > 0;) {
+            if (!(fds[w + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            worker_connection& c = workers[w];
+
+            uint8_t type;
+            tile_result result;
+            if (!recv_all(c.fd, &type, 1) || type != msg_result || !recv_all(c.fd, &result, sizeof(result))) {
+                drop(w, "was lost");
+                continue;
+            }
+
+            // the pixels are only read into a buffer the size of a tile the worker was given,
+            // whatever tile it claims to send
+            auto it = std::find_if(c.tiles.begin(), c.tiles.end(), [&](const pixel_tile& o) {
+                return o.x0 == result.tile.x0 && o.y0 == result.tile.y0 && o.x1 == result.tile.x1 && o.y1 == result.tile.y1;
+            });
+            if (it == c.tiles.end()) {
+                drop(w, "sent a tile it was not given");
+                continue;
+            }
+
+            const pixel_tile t = *it;
+            std::vector<tile_pixel> pixels((t.x1 - t.x0) * (t.y1 - t.y0));
+            if (!recv_all(c.fd, pixels.data(), pixels.size() * sizeof(tile_pixel))) {
+                drop(w, "was lost");
+                continue;
+            }
+            c.tiles.erase(it);
+            c.tiles_done++;
+            n_done++;
+
+            if (c.tiles.empty()) {
+                Float job_seconds = std::chrono::duration<Float>(std::chrono::steady_clock::now() - c.job_start).count();
+                mean_job_seconds = n_jobs_done == 0 ? job_seconds : 0.8 * mean_job_seconds + 0.2 * job_seconds;
+                n_jobs_done++;
+            }
+
+            int k = 0;
+            for (int j = t.y0; j < t.y1; j++) {
+                for (int i = t.x0; i < t.x1; i++, k++) {
+                    const tile_pixel& p = pixels[k];
+                    image.add_pixel(j * image.width + i, color(p.sum[0], p.sum[1], p.sum[2]), p.sum_sq, p.samples);
+                }
+            }
+
+            if (stream) stream->push(make_tile_update(t, image, nullptr));
+
+            std::lock_guard<std::mutex> lock(ray_stats_mtx);
+            total_ray_stats += result.stats;
+        }
+
+        // hellos are read as far as they arrived without waiting for the rest,
+        // connections that do not complete theirs within the timeout are closed
+        auto now = std::chrono::steady_clock::now();
+        for (size_t g = greetings.size(); g-- > 0;) {
+            greeting& gr = greetings[g];
+            int fd = gr.fd;
+            bool failed = false;
+            if (fds[first_greeting + g].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t n = recv(fd, reinterpret_cast<char*>(&gr.hello) + gr.received, sizeof(gr.hello) - gr.received, MSG_DONTWAIT);
+                if (n > 0) gr.received += n;
+                else failed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            }
+            if (!failed && gr.received < sizeof(gr.hello)) {
+                if (now - gr.since > std::chrono::seconds(coordinator_recv_timeout)) {
+                    log << "\t\tClosed a connection that sent no worker hello\n";
+                    close(fd);
+                    greetings.erase(greetings.begin() + g);
+                }
+                continue;
+            }
+
+            worker_hello hello = gr.hello;
+            greetings.erase(greetings.begin() + g);
+            if (failed || hello.magic != worker_magic) {
+                log << "\t\tIgnored a connection that is no worker\n";
+                close(fd);
+            } else if (hello.image_width != image.width || hello.image_height != image.height || hello.samples != n_samples) {
+                log << "\t\tRejected a worker rendering " << hello.image_width << "x" << hello.image_height
+                    << " with " << hello.samples << " samples, its options differ\n";
+                close(fd);
+            } else {
+                workers.push_back({ fd, n_connected++, 2 * std::max(hello.n_threads, 1), {}, 0, {} });
+                log << "\t\tWorker " << workers.back().id << " connected with " << hello.n_threads << " threads\n" << std::flush;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                // a result or hello that stops halfway fails the recv, the worker is then dropped
+                // and its tiles are handed out again
+                set_recv_timeout(fd, coordinator_recv_timeout);
+                enable_keepalive(fd);
+                greetings.push_back({ fd, std::chrono::steady_clock::now(), {}, 0 });
+            }
+        }
+
+        progress << "\rPixel blocks remaining: " << tiles.size() - n_done << ", workers: " << workers.size() << "    " << std::flush;
+    }
+
+    for (const auto& g : greetings) close(g.fd);
+
+    for (const auto& c : workers) {
+        uint8_t type = msg_quit;
+        send_all(c.fd, &type, 1);
+        close(c.fd);
+        log << "\t\tWorker " << c.id << " rendered " << c.tiles_done << " tiles\n";
+    }
+    close(listen_fd);
+
+    for (pid_t pid : children)
+        if (pid > 0) waitpid(pid, nullptr, 0);
+
+    log << "\t" << n_connected << " workers connected, " << n_lost << " lost\n";
+    return ok;
+}
+
+#endif //DISTRIBUTED_H
@@ -0,0 +1,217 @@
+#ifndef FILM_H
+#define FILM_H
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <charconv>
+
+#include "utility.hpp"
+#include "color.hpp"
+
+inline Float luminance(const color& c) {
+    return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
+/*
+ * Accumulation buffer the render passes add their samples to.
+ * Per pixel it keeps the sum of the sample colors, the sum of their squared
+ * luminance and the sample count, so the image can be written and its noise
+ * estimated after any pass. Threads add to disjoint tiles, nothing is locked.
+ */
+class film {
+    public:
+        const int width, height;
+
+        film(int width, int height)
+            : width{ width }, height{ height }, sum(width * height), sum_sq(width * height, 0), samples(width * height, 0) {}
+
+        void add_sample(int pixel, const color& c) {
+            sum[pixel] += c;
+            Float l = luminance(c);
+            sum_sq[pixel] += l * l;
+            samples[pixel]++;
+        }
+
+        int sample_count(int pixel) const { return samples[pixel]; }
+
+        // raw sums of a pixel, so a tile rendered elsewhere can be sent over and merged with add_pixel
+        const color& pixel_sum(int pixel) const { return sum[pixel]; }
+        Float pixel_sum_sq(int pixel) const { return sum_sq[pixel]; }
+
+        void add_pixel(int pixel, const color& s, Float s_sq, int n) {
+            sum[pixel] += s;
+            sum_sq[pixel] += s_sq;
+            samples[pixel] += n;
+        }
+
+        long long total_samples() const;
+
+        // move every sample of other, a film of the same size, into this one and leave other empty
+        void take_samples(film& other);
+
+        // standard error of the pixel's mean in display units, after the gamma of 2
+        // write_color applies, so dark and bright pixels are weighed as they are seen.
+        // With fewer than 2 samples nothing is known and the error is the whole range, 1
+        Float pixel_error(int pixel) const;
+
+        // average pixel_error over the image
+        Float noise() const;
+
+        // the mean of every pixel as a ppm image
+        void write(std::ostream& out) const;
+
+        // the raw sums and counts of every pixel, for checkpoints.
+        // read_state returns false if in ends before all of them are read
+        void write_state(std::ostream& out) const;
+        bool read_state(std::istream& in);
+
+    private:
+        std::vector<color> sum;
+        std::vector<Float> sum_sq;
+        std::vector<int> samples;
+};
+
+long long film::total_samples() const {
+    long long n = 0;
+    for (int s : samples) n += s;
+    return n;
+}
+
+void film::take_samples(film& other) {
+    for (int p = 0; p < width * height; p++) {
+        if (other.samples[p] == 0) continue;
+        add_pixel(p, other.sum[p], other.sum_sq[p], other.samples[p]);
+        other.sum[p] = color(0.0);
+        other.sum_sq[p] = 0;
+        other.samples[p] = 0;
+    }
+}
+
+Float film::pixel_error(int pixel) const {
+    int n = samples[pixel];
+    if (n < 2) return 1;
+
+    Float mean = luminance(sum[pixel]) / n;
+    Float variance = std::max(Float(0), (sum_sq[pixel] - mean * mean * n) / (n - 1));
+    Float error = sqrt(variance / n);
+
+    // d sqrt(L) = dL / (2 sqrt(L)), kept finite for black pixels
+    return std::min(Float(1), error / (2 * sqrt(std::max(mean, Float(1e-4)))));
+}
+
+Float film::noise() const {
+    Float total = 0;
+    for (int i = 0; i < width * height; i++)
+        total += pixel_error(i);
+    return total / (width * height);
+}
+
+void film::write_state(std::ostream& out) const {
+    out.write(reinterpret_cast<const char*>(sum.data()), sum.size() * sizeof(color));
+    out.write(reinterpret_cast<const char*>(sum_sq.data()), sum_sq.size() * sizeof(Float));
+    out.write(reinterpret_cast<const char*>(samples.data()), samples.size() * sizeof(int));
+}
+
+bool film::read_state(std::istream& in) {
+    in.read(reinterpret_cast<char*>(sum.data()), sum.size() * sizeof(color));
+    in.read(reinterpret_cast<char*>(sum_sq.data()), sum_sq.size() * sizeof(Float));
+    in.read(reinterpret_cast<char*>(samples.data()), samples.size() * sizeof(int));
+    return static_cast<bool>(in);
+}
+
+void film::write(std::ostream& out) const {
+    out << "P3\n" << width << ' ' << height << "\n255\n";
+
+    // the same values write_color writes, formatted into one buffer and written at once,
+    // going through the stream for every number made this a slow serial tail on large images
+    std::string text;
+    text.reserve(static_cast<size_t>(12) * width * height);
+    char digits[8];
+
+    for (int j = height - 1; j >= 0; j--) {
+        for (int i = 0; i < width; i++) {
+            int p = j * width + i;
+            Float scale = 1.0 / static_cast<Float>(std::max(samples[p], 1));
+            Float channels[3] = { sqrt(sum[p].x * scale), sqrt(sum[p].y * scale), sqrt(sum[p].z * scale) };
+
+            for (int c = 0; c < 3; c++) {
+                auto end = std::to_chars(digits, digits + sizeof(digits), static_cast<int>(256 * clamp(channels[c], 0, 0.9999))).ptr;
+                text.append(digits, end);
+                text.push_back(c < 2 ? ' ' : '\n');
+            }
+        }
+    }
+
+    out.write(text.data(), text.size());
+}
+
+/*
+ * Root mean square of pixel_error over the (2 radius + 1)^2 window around every pixel.
+ * A few samples often miss the rare paths that make a pixel noisy, its neighbours
+ * see the same light, so pooling their errors keeps such a pixel from looking converged.
+ */
+std::vector<Float> pooled_pixel_errors(const film& image, int radius) {
+    const int w = image.width, h = image.height;
+    std::vector<Float> sq(w * h), rows(w * h), pooled(w * h);
+    for (int i = 0; i < w * h; i++) {
+        Float e = image.pixel_error(i);
+        sq[i] = e * e;
+    }
+
+    // separable box filter, windows are clipped at the image border
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            Float s = 0;
+            int n = 0;
+            for (int x = std::max(0, i - radius); x <= std::min(w - 1, i + radius); x++, n++) s += sq[j * w + x];
+            rows[j * w + i] = s / n;
+        }
+    }
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            Float s = 0;
+            int n = 0;
+            for (int y = std::max(0, j - radius); y <= std::min(h - 1, j + radius); y++, n++) s += rows[y * w + i];
+            pooled[j * w + i] = sqrt(s / n);
+        }
+    }
+
+    return pooled;
+}
+
+/*
+ * Adaptive sampling: mark the pixels that get n_samples more in the next pass.
+ * A pixel takes part while its error, pooled with its neighbours', is above threshold
+ * and it has fewer than max_samples. If the remaining budget of samples cannot cover
+ * all of them, only the noisiest ones are picked, so samples saved on converged
+ * pixels go where the image is noisiest. Returns the number of pixels marked.
+ */
+int select_noisy_pixels(const film& image, Float threshold, int max_samples, long long budget,
+        int n_samples, std::vector<uint8_t>& active) {
+    const int n_pixels = image.width * image.height;
+    active.assign(n_pixels, 0);
+
+    std::vector<Float> error = pooled_pixel_errors(image, 2);
+
+    std::vector<std::pair<Float, int>> noisy;
+    for (int i = 0; i < n_pixels; i++) {
+        if (image.sample_count(i) + n_samples > max_samples) continue;
+        if (error[i] > threshold) noisy.push_back({ error[i], i });
+    }
+
+    // a resumed image can already hold more than the budget
+    long long affordable = std::max(0ll, budget / n_samples);
+    if (static_cast<long long>(noisy.size()) > affordable) {
+        std::nth_element(noisy.begin(), noisy.begin() + affordable, noisy.end(),
+            [](const std::pair<Float, int>& a, const std::pair<Float, int>& b) { return a.first > b.first; });
+        noisy.resize(affordable);
+    }
+
+    for (const auto& p : noisy) active[p.second] = 1;
+    return noisy.size();
+}
+
+#endif //FILM_H
@@ -0,0 +1,79 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+
+#include "utility.hpp"
+#include "color.hpp"
+#include "stats.hpp"
+#include "film.hpp"
+
+// false color ramp, 0 is blue, then cyan, green, yellow and 1 is red
+color heat_color(Float x) {
+    x = clamp(x, 0, 1);
+    const color stops[5] = {
+        color(0, 0, 1), color(0, 1, 1), color(0, 1, 0), color(1, 1, 0), color(1, 0, 0)
+    };
+    Float f = x * 4;
+    int i = std::min(static_cast<int>(f), 3);
+    Float w = f - i;
+    return (1 - w) * stops[i] + w * stops[i + 1];
+}
+
+/*
+ * Write values (one per pixel, bottom row first like the render) as a false color
+ * image through write_image. The 99th percentile maps to red so a few extreme
+ * pixels do not wash out the rest. Returns the value that maps to red.
+ */
+Float write_heatmap(const std::string& path, const std::vector<Float>& values, int image_width, int image_height) {
+    std::vector<Float> sorted(values);
+    size_t p99 = sorted.empty() ? 0 : (sorted.size() - 1) * 99 / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + p99, sorted.end());
+    Float scale = sorted.empty() ? 0 : sorted[p99];
+
+    std::vector<color> pixels(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        color c = heat_color(scale > 0 ? values[i] / scale : 0);
+        // write_color applies a gamma of 2, square to keep the ramp as is
+        pixels[i] = c * c;
+    }
+
+    std::ofstream out(path);
+    write_image(out, pixels.data(), image_width, image_height, 1, 1);
+    return scale;
+}
+
+/*
+ * Heatmaps of node visits and primitive tests per camera sample,
+ * written to <prefix>_nodes.ppm and <prefix>_prims.ppm
+ */
+void write_traversal_heatmaps(const std::string& prefix, const ray_stats* pixel_stats,
+    const film& image, std::ostream& log
+) {
+    std::vector<Float> nodes(image.width * image.height), prims(image.width * image.height);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        Float samples = std::max(image.sample_count(i), 1);
+        nodes[i] = static_cast<Float>(pixel_stats[i].nodes_visited) / samples;
+        prims[i] = static_cast<Float>(pixel_stats[i].primitive_tests) / samples;
+    }
+
+    Float node_scale = write_heatmap(prefix + "_nodes.ppm", nodes, image.width, image.height);
+    Float prim_scale = write_heatmap(prefix + "_prims.ppm", prims, image.width, image.height);
+
+    log << "\tWrote " << prefix << "_nodes.ppm, red is " << node_scale << " node visits per sample\n";
+    log << "\tWrote " << prefix << "_prims.ppm, red is " << prim_scale << " primitive tests per sample\n";
+}
+
+// false color image of the samples every pixel received
+void write_sample_count_map(const std::string& path, const film& image, std::ostream& log) {
+    std::vector<Float> counts(image.width * image.height);
+    for (size_t i = 0; i < counts.size(); i++) counts[i] = image.sample_count(i);
+
+    Float scale = write_heatmap(path, counts, image.width, image.height);
+    log << "\tWrote " << path << ", red is " << scale << " samples per pixel\n";
+}
+
+#endif //HEATMAP_H
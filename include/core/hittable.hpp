@@ -3,6 +3,7 @@
 
 #include "utility.hpp"
 #include "aabb.hpp"
+#include "ray_packet.hpp"
 
 class material;
 
@@ -30,6 +31,23 @@ class hittable {
         virtual bool hit(const ray& r, Float t_min, 
             Float t_max, hit_record& rec) const = 0;
 
+        // any hit in (t_min, t_max), for visibility tests. Stops at the first hit found
+        // and fills no hit_record, shapes and accelerators override this to skip that work
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const {
+            hit_record rec;
+            return hit(r, t_min, t_max, rec);
+        }
+
+        // closest hits of every lane of the packet in (t_min, packet.t_max[i]).
+        // A lane that hits gets recs[i] filled and its t_max lowered.
+        // The default traces the lanes one by one, BVHs override it to share node visits
+        virtual void hit_packet(ray_packet& packet, Float t_min, hit_record recs[]) const {
+            for (int i = 0; i < packet.size; i++) {
+                if (hit(packet.rays[i], t_min, packet.t_max[i], recs[i]))
+                    packet.record_hit(i, recs[i].t);
+            }
+        }
+
         virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const = 0;
 };
 
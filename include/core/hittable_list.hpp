@@ -25,6 +25,10 @@ class hittable_list : public hittable {
         virtual bool hit(
             const ray& r, Float t_min, Float t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
+        virtual void hit_packet(ray_packet& packet, Float t_min, hit_record recs[]) const override;
+
         virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override;
 };
 
@@ -44,6 +48,21 @@ bool hittable_list::hit(const ray& r, Float t_min, Float t_max, hit_record& rec)
     return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, Float t_min, Float t_max) const {
+    for (const auto& object : objects) {
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    }
+
+    return false;
+}
+
+// every object only sees the lanes' closest hits so far through packet.t_max
+void hittable_list::hit_packet(ray_packet& packet, Float t_min, hit_record recs[]) const {
+    for (const auto& object : objects)
+        object->hit_packet(packet, t_min, recs);
+}
+
 bool hittable_list::bounding_box(Float time0, Float time1, aabb& output_box) const  {
     if (objects.empty()) return false;
 
@@ -3,14 +3,16 @@
 
 #include "utility.hpp"
 #include "hittable.hpp"
+#include "sampler.hpp"
 #include <iostream>
 
 class material {
     public:
         virtual ~material() {}
 
+        // rng is the sampler of the calling render thread
         virtual bool scatter(const ray& r_in, const hit_record& rec, 
-                color& attenuation, ray& scattered) const = 0;
+                color& attenuation, ray& scattered, sampler& rng) const = 0;
         
         virtual color emitted() const {
             return color(0.0);
@@ -24,10 +26,10 @@ class lambertian : public material {
         lambertian(const color& a) : albedo { a } {}
 
         virtual bool scatter(const ray& r_in, const hit_record& rec, 
-            color& attenuation, ray& scattered
+            color& attenuation, ray& scattered, sampler& rng
         ) const override {
             // true lambertian diffuse
-            vec3 scatter_direction = rec.normal + random_unit_vector();
+            vec3 scatter_direction = rec.normal + rng.unit_vector();
 
             // catch degenerate scatter direction
             if (scatter_direction.near_zero())
@@ -48,10 +50,10 @@ class metal : public material {
         metal(const color& a, Float f) : albedo { a }, fuzz { f < 1? f : 1 } {}
 
         virtual bool scatter(const ray& r_in, const hit_record& rec, 
-            color& attenuation, ray& scattered
+            color& attenuation, ray& scattered, sampler& rng
         ) const override {
             vec3 reflected = reflect(unit_vector(r_in.dir), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time);
+            scattered = ray(rec.p, reflected + fuzz * rng.in_unit_sphere(), r_in.time);
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
@@ -75,7 +77,7 @@ class dielectric : public material {
         }
 
         virtual bool scatter(const ray& r_in, const hit_record& rec, 
-            color& attenuation, ray& scattered
+            color& attenuation, ray& scattered, sampler& rng
         ) const override {
             attenuation = albedo;
             Float refraction_ratio = rec.front_face ? (1.0/ir) : ir;
@@ -88,7 +90,7 @@ class dielectric : public material {
 
             vec3 direction;
 
-            if (cannot_refract || schlick_reflectance(cos_theta, refraction_ratio) > random_Float())
+            if (cannot_refract || schlick_reflectance(cos_theta, refraction_ratio) > rng.uniform())
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -106,7 +108,7 @@ class diffuse_light : public material {
         diffuse_light(color c) : emit { c } {}
         diffuse_light() : emit { color(1.0) } {}
 
-        virtual bool scatter(const ray&, const hit_record&, color&, ray& ) const override {
+        virtual bool scatter(const ray&, const hit_record&, color&, ray&, sampler&) const override {
             return false;
         }
 
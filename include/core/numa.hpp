@@ -0,0 +1,150 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <fstream>
+#include <sstream>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "film.hpp"
+
+/*
+ * NUMA placement of the render threads
+ *   off:       threads run wherever the scheduler puts them
+ *   pin:       threads are pinned to cpus spread over the nodes, with a sample buffer per node
+ *   replicate: pin, and every node also traces its own copy of the traversal structure
+ */
+enum class numa_mode { off, pin, replicate };
+
+const char* numa_mode_name(numa_mode mode) {
+    switch (mode) {
+        case numa_mode::pin: return "pin";
+        case numa_mode::replicate: return "replicate";
+        default: return "off";
+    }
+}
+
+/*
+ * CPUs of every NUMA node, from /sys/devices/system/node.
+ * Without that, one node holding every hardware thread.
+ */
+struct numa_topology {
+    std::vector<std::vector<int>> node_cpus;
+
+    int nodes() const { return static_cast<int>(node_cpus.size()); }
+
+    int cpus(int n_nodes) const {
+        int n = 0;
+        for (int i = 0; i < n_nodes && i < nodes(); i++) n += node_cpus[i].size();
+        return n;
+    }
+};
+
+// cpus of a kernel cpu list such as "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int c = first; c <= last; c++) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+numa_topology read_numa_topology() {
+    numa_topology topo;
+    for (int node = 0; ; node++) {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!in) break;
+
+        std::string list;
+        std::getline(in, list);
+        std::vector<int> cpus = parse_cpu_list(list);
+        // memory only nodes have no cpus to run threads on
+        if (!cpus.empty()) topo.node_cpus.push_back(cpus);
+    }
+
+    if (topo.node_cpus.empty()) {
+        topo.node_cpus.emplace_back();
+        for (int c = 0; c < static_cast<int>(std::max(1u, std::thread::hardware_concurrency())); c++)
+            topo.node_cpus[0].push_back(c);
+    }
+    return topo;
+}
+
+// false if the calling thread could not be bound to cpu
+bool pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/*
+ * Run f on a thread pinned to the first cpu of node and return what it returns.
+ * Linux places pages on the node of the thread that first writes them,
+ * so memory that f allocates and fills is local to node.
+ */
+template<typename F>
+auto run_on_node(const numa_topology& topo, int node, F f) -> decltype(f()) {
+    decltype(f()) result;
+    std::thread t([&]() {
+        pin_current_thread(topo.node_cpus[node][0]);
+        result = f();
+    });
+    t.join();
+    return result;
+}
+
+/*
+ * Where the render threads run: thread t is pinned to cpu[t] on node[t], traces
+ * worlds[node[t]] and adds its samples to buffers[node[t]], which render_pass
+ * merges into the image after the pass. A node's buffer is only written by
+ * the threads of that node and was allocated there, so the samples never
+ * cross the interconnect until the merge.
+ */
+struct render_placement {
+    std::vector<int> cpu;
+    std::vector<int> node;
+    std::vector<const hittable*> worlds;
+    std::vector<std::unique_ptr<film>> buffers;
+
+    int threads() const { return static_cast<int>(cpu.size()); }
+};
+
+/*
+ * n_threads spread evenly over the first n_nodes nodes, each node filling its
+ * cpus in order, with a buffer of width by height allocated on every node used.
+ * Every node traces world until the caller puts replicas in worlds.
+ */
+render_placement place_render_threads(const numa_topology& topo, int n_threads, int n_nodes,
+        const hittable& world, int width, int height) {
+    n_nodes = std::max(1, std::min(n_nodes, topo.nodes()));
+
+    render_placement p;
+    for (int t = 0; t < n_threads; t++) {
+        int node = t % n_nodes;
+        const std::vector<int>& cpus = topo.node_cpus[node];
+        p.node.push_back(node);
+        p.cpu.push_back(cpus[(t / n_nodes) % cpus.size()]);
+    }
+
+    for (int node = 0; node < n_nodes; node++) {
+        p.worlds.push_back(&world);
+        p.buffers.push_back(run_on_node(topo, node, [&]() { return std::make_unique<film>(width, height); }));
+    }
+    return p;
+}
+
+#endif //NUMA_H
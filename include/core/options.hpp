@@ -0,0 +1,507 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <iostream>
+#include <string>
+
+#include "utility.hpp"
+#include "bvh_node.hpp"
+#include "accelerator.hpp"
+#include "color.hpp"
+#include "numa.hpp"
+
+/*
+ * Scene that gets rendered
+ *   obj:       the .obj file on a ground sphere
+ *   instances: the .obj file built once as a bottom level BVH and placed many times,
+ *              with a top level BVH over the instances
+ *   moving:    random_moving_scene, small spheres rising during the shutter
+ *   caustic:   caustic_demo, a glass sphere under a small light
+ */
+enum class scene_type { obj, instances, moving, caustic };
+
+/*
+ * Settings that can be overridden from the command line
+ * every option is passed as --name=value
+ */
+struct render_options {
+    std::string obj_file = "/Users/Lars/git/cpp_raytracer/models/geodesic/geodesic_classI_2.obj";
+    std::string log_file = "log.log";
+
+    // directory for cached BVHs, empty disables the cache
+    std::string bvh_cache;
+
+    // log node counts, depth and leaf size histograms and overlap of the built tree,
+    // for sbvh also the traversal cost against a plain SAH build
+    bool bvh_report = false;
+
+    // prefix of the node visit and primitive test heatmaps, empty writes none
+    std::string heatmap;
+
+    scene_type scene = scene_type::obj;
+    int n_instances = 64;
+
+    // frames of mesh animation before the rendered one, the BVH is refit every frame
+    // and rebuilt once its SAH cost grows past rebuild_threshold times the built cost
+    int frames = 1;
+    Float rebuild_threshold = 1.5;
+
+    bvh_build_params bvh;
+    accel_type accel = accel_type::linear;
+
+    // time segments of the motion BVH, 0 picks them from the amount of motion
+    int time_segments = 0;
+
+    // pack triangles in wide BVH leaves into SIMD clusters
+    bool triangle_clusters = true;
+
+    // camera rays traced together per packet, 0 traces every ray on its own
+    int packet_size = 0;
+
+    // paths per batch of the wavefront integrator, 0 uses the recursive integrator
+    int wavefront_size = 0;
+
+    // threads rendering tiles, 0 for one per hardware thread
+    int render_threads = 0;
+
+    // edge of the square render tiles in pixels, 0 picks it from the image size, thread
+    // count and a pilot measurement. Tiles are handed out in tiling order
+    int tile_size = 0;
+    tile_order tiling = tile_order::hilbert;
+
+    // NUMA placement of the render threads over the first numa_nodes nodes, 0 for all.
+    // numa_bench renders once on 1, 2, ... nodes first and logs how the ray rate scales
+    numa_mode numa = numa_mode::off;
+    int numa_nodes = 0;
+    bool numa_bench = false;
+
+    // log samples per second of random_Float and the sampler before rendering
+    bool sampler_bench = false;
+
+    // samples per pixel, rendered in passes of pass_samples. Rendering stops early once
+    // time_budget seconds would be exceeded or the noise estimate is at most noise_target,
+    // a budget of 0 is off. preview is an image rewritten after every pass
+    int samples = 64;
+    int pass_samples = 0;
+    Float time_budget = 0;
+    Float noise_target = 0;
+    std::string preview;
+
+    // adaptive sampling: after min_samples everywhere, passes only go to pixels whose error
+    // is above adaptive_error (0 is off) and have fewer than max_samples (0 for 4 times samples),
+    // noisiest first, until samples per pixel are spent on average. spp_map is an image of the counts
+    Float adaptive_error = 0;
+    int min_samples = 16;
+    int max_samples = 0;
+    std::string spp_map;
+
+    // checkpoints of the accumulated image are written to checkpoint between passes, at most
+    // every checkpoint_interval seconds and once more at the end. resume continues a render
+    // from a checkpoint, adding samples until samples per pixel are reached
+    std::string checkpoint;
+    Float checkpoint_interval = 300;
+    std::string resume;
+
+    // file or named pipe finished tiles are streamed to while rendering, empty for none
+    std::string stream;
+
+    // file, or unix:<socket> for a listening unix domain socket, that a JSON line of render
+    // telemetry is written to every telemetry_interval seconds, empty for none
+    std::string telemetry;
+    Float telemetry_interval = 1;
+
+    // distributed rendering: a coordinator listens on coordinator_port (-1 is off, 0 picks
+    // a free port) and starts local_workers worker processes, more can connect from other
+    // machines. A worker connects to the coordinator at worker, given as host:port
+    int coordinator_port = -1;
+    int local_workers = 0;
+    std::string worker;
+};
+
+void print_usage(std::ostream& out, const char* program) {
+    out << "Usage: " << program << " [options] > image.ppm\n"
+        << "  --obj=<path>          .obj file to render\n"
+        << "  --log=<path>          log file (default log.log)\n"
+        << "  --bvh-cache=<dir>     load the obj mesh and its linear BVH from a cache in dir,\n"
+        << "                        writing it on a miss (default off)\n"
+        << "  --scene=<obj|instances|moving|caustic>\n"
+        << "                        render the mesh once or many instances of it (default obj)\n"
+        << "  --instances=<n>       number of instances for --scene=instances (default 64)\n"
+        << "  --frames=<n>          animate the obj mesh for n frames and render the last (default 1)\n"
+        << "  --rebuild-threshold=<x>\n"
+        << "                        rebuild instead of refit once the SAH cost grew x times (default 1.5)\n"
+        << "  --bvh-report=<on|off> log the quality of the built tree, for sbvh also its traversal\n"
+        << "                        cost against a plain SAH tree (default off)\n"
+        << "  --heatmap=<prefix>    write traversal cost heatmaps to <prefix>_nodes.ppm and <prefix>_prims.ppm\n"
+        << "  --bvh=<median|sah|sbvh>\n"
+        << "                        BVH split method, sbvh adds spatial splits (default median)\n"
+        << "  --leaf-size=<n>       largest leaf the SAH builders may create (default 4)\n"
+        << "  --split-budget=<x>    extra references sbvh may create, relative to the primitive count (default 1)\n"
+        << "  --accel=<tree|linear|bvh4|bvh8|cbvh4|cbvh8|motion>\n"
+        << "                        structure traversed while rendering (default linear)\n"
+        << "  --time-segments=<n>   shutter segments of the motion BVH, 0 to choose (default 0)\n"
+        << "  --tri-clusters=<on|off>\n"
+        << "                        SIMD triangle clusters in wide BVH leaves (default on)\n"
+        << "  --build-threads=<n>   threads used to build the BVH, 0 for all (default 0)\n"
+        << "  --threads=<n>         threads used to render, 0 for all (default 0)\n"
+        << "  --tile-size=<n>       render tile edge in pixels, 0 to choose (default 0)\n"
+        << "  --tile-order=<hilbert|morton|rows>\n"
+        << "                        order tiles are rendered in (default hilbert)\n"
+        << "  --numa=<off|pin|replicate>\n"
+        << "                        pin render threads over the NUMA nodes with a sample buffer per node,\n"
+        << "                        replicate also copies the BVH to every node (default off)\n"
+        << "  --numa-nodes=<n>      NUMA nodes to render on, 0 for all (default 0)\n"
+        << "  --numa-bench=<on|off> first log the ray rate on 1, 2, ... NUMA nodes (default off)\n"
+        << "  --sampler-bench=<on|off>\n"
+        << "                        first log how fast random_Float and the sampler draw samples (default off)\n"
+        << "  --samples=<n>         samples per pixel (default 64)\n"
+        << "  --pass-samples=<n>    samples per pixel in every progressive pass, 0 renders all at once\n"
+        << "                        unless a budget or preview is set, then 4 (default 0)\n"
+        << "  --time-budget=<s>     stop before a pass would end after s seconds of rendering (default off)\n"
+        << "  --noise-target=<x>    stop once the mean pixel error is at most x of the display range (default off)\n"
+        << "  --preview=<path>      rewrite the image so far to path after every pass (default off)\n"
+        << "  --adaptive=<x>        adaptive sampling, only pixels with an error above x get more samples,\n"
+        << "                        the same samples in total go to the noisiest pixels (default off)\n"
+        << "  --min-samples=<n>     samples every pixel gets before adaptive sampling starts (default 16)\n"
+        << "  --max-samples=<n>     most samples a pixel gets with adaptive sampling, 0 for 4x --samples (default 0)\n"
+        << "  --spp-map=<path>      write an image of the samples every pixel received (default off)\n"
+        << "  --checkpoint=<path>   save the accumulated image to path between passes and at the end (default off)\n"
+        << "  --checkpoint-interval=<s>\n"
+        << "                        least seconds between checkpoints (default 300)\n"
+        << "  --resume=<path>       continue from a checkpoint, --samples is the new total (default off)\n"
+        << "  --stream=<path>       stream finished tiles to a file or pipe as they complete (default off)\n"
+        << "  --telemetry=<path>    write JSON lines of rays, tiles, thread utilization and ETA to a file,\n"
+        << "                        or to a unix socket given as unix:<path> (default off)\n"
+        << "  --telemetry-interval=<s>\n"
+        << "                        seconds between telemetry lines (default 1)\n"
+        << "  --packets=<off|8|16>  trace camera rays in packets of 8 or 16, SIMD traversal\n"
+        << "                        with --accel=linear (default off)\n"
+        << "  --coordinator=<port>  render on worker processes, listening for them on port, 0 for any\n"
+        << "                        free port (default off)\n"
+        << "  --local-workers=<n>   worker processes the coordinator starts on this machine (default 0)\n"
+        << "  --worker=<host:port>  render tiles for the coordinator at host:port, with the same options\n"
+        << "  --wavefront=<n>       trace paths in batches of n with the wavefront integrator,\n"
+        << "                        0 for the recursive one (default 0)\n";
+}
+
+// returns false if the arguments could not be parsed, errors are written to err
+bool parse_options(int argc, char** argv, render_options& opts, std::ostream& err) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        if (arg == "--help" || arg == "-h") {
+            print_usage(err, argv[0]);
+            return false;
+        }
+
+        size_t eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+            err << "Unrecognized argument \"" << arg << "\"\n";
+            print_usage(err, argv[0]);
+            return false;
+        }
+
+        std::string name = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+
+        try {
+            if (name == "obj") {
+                opts.obj_file = value;
+            } else if (name == "log") {
+                opts.log_file = value;
+            } else if (name == "bvh-cache") {
+                opts.bvh_cache = value;
+            } else if (name == "scene") {
+                if (value == "obj") {
+                    opts.scene = scene_type::obj;
+                } else if (value == "instances") {
+                    opts.scene = scene_type::instances;
+                } else if (value == "moving") {
+                    opts.scene = scene_type::moving;
+                } else if (value == "caustic") {
+                    opts.scene = scene_type::caustic;
+                } else {
+                    err << "Unknown scene \"" << value << "\"\n";
+                    return false;
+                }
+            } else if (name == "instances") {
+                opts.n_instances = std::stoi(value);
+                if (opts.n_instances < 1) {
+                    err << "--instances must be at least 1\n";
+                    return false;
+                }
+            } else if (name == "frames") {
+                opts.frames = std::stoi(value);
+                if (opts.frames < 1) {
+                    err << "--frames must be at least 1\n";
+                    return false;
+                }
+            } else if (name == "rebuild-threshold") {
+                opts.rebuild_threshold = std::stod(value);
+                if (opts.rebuild_threshold < 1) {
+                    err << "--rebuild-threshold must be at least 1\n";
+                    return false;
+                }
+            } else if (name == "bvh") {
+                if (value == "median") {
+                    opts.bvh.split_method = bvh_split_method::median;
+                } else if (value == "sah") {
+                    opts.bvh.split_method = bvh_split_method::sah;
+                } else if (value == "sbvh") {
+                    opts.bvh.split_method = bvh_split_method::sbvh;
+                } else {
+                    err << "Unknown BVH split method \"" << value << "\"\n";
+                    return false;
+                }
+            } else if (name == "accel") {
+                if (value == "tree") {
+                    opts.accel = accel_type::tree;
+                } else if (value == "linear") {
+                    opts.accel = accel_type::linear;
+                } else if (value == "bvh4") {
+                    opts.accel = accel_type::bvh4;
+                } else if (value == "bvh8") {
+                    opts.accel = accel_type::bvh8;
+                } else if (value == "cbvh4") {
+                    opts.accel = accel_type::cbvh4;
+                } else if (value == "cbvh8") {
+                    opts.accel = accel_type::cbvh8;
+                } else if (value == "motion") {
+                    opts.accel = accel_type::motion;
+                } else {
+                    err << "Unknown acceleration structure \"" << value << "\"\n";
+                    return false;
+                }
+            } else if (name == "time-segments") {
+                opts.time_segments = std::stoi(value);
+                if (opts.time_segments < 0) {
+                    err << "--time-segments must not be negative\n";
+                    return false;
+                }
+            } else if (name == "bvh-report") {
+                if (value == "on") {
+                    opts.bvh_report = true;
+                } else if (value == "off") {
+                    opts.bvh_report = false;
+                } else {
+                    err << "--bvh-report must be on or off\n";
+                    return false;
+                }
+            } else if (name == "heatmap") {
+                opts.heatmap = value;
+            } else if (name == "tri-clusters") {
+                if (value == "on") {
+                    opts.triangle_clusters = true;
+                } else if (value == "off") {
+                    opts.triangle_clusters = false;
+                } else {
+                    err << "--tri-clusters must be on or off\n";
+                    return false;
+                }
+            } else if (name == "build-threads") {
+                opts.bvh.n_threads = std::stoi(value);
+                if (opts.bvh.n_threads < 0) {
+                    err << "--build-threads must not be negative\n";
+                    return false;
+                }
+            } else if (name == "threads") {
+                opts.render_threads = std::stoi(value);
+                if (opts.render_threads < 0) {
+                    err << "--threads must not be negative\n";
+                    return false;
+                }
+            } else if (name == "samples") {
+                opts.samples = std::stoi(value);
+                if (opts.samples < 1) {
+                    err << "--samples must be at least 1\n";
+                    return false;
+                }
+            } else if (name == "pass-samples") {
+                opts.pass_samples = std::stoi(value);
+                if (opts.pass_samples < 0) {
+                    err << "--pass-samples must not be negative\n";
+                    return false;
+                }
+            } else if (name == "time-budget") {
+                opts.time_budget = std::stod(value);
+                if (opts.time_budget < 0) {
+                    err << "--time-budget must not be negative\n";
+                    return false;
+                }
+            } else if (name == "noise-target") {
+                opts.noise_target = std::stod(value);
+                if (opts.noise_target < 0) {
+                    err << "--noise-target must not be negative\n";
+                    return false;
+                }
+            } else if (name == "preview") {
+                opts.preview = value;
+            } else if (name == "adaptive") {
+                opts.adaptive_error = std::stod(value);
+                if (opts.adaptive_error < 0) {
+                    err << "--adaptive must not be negative\n";
+                    return false;
+                }
+            } else if (name == "min-samples") {
+                opts.min_samples = std::stoi(value);
+                if (opts.min_samples < 2) {
+                    err << "--min-samples must be at least 2, the error needs two samples\n";
+                    return false;
+                }
+            } else if (name == "max-samples") {
+                opts.max_samples = std::stoi(value);
+                if (opts.max_samples < 0) {
+                    err << "--max-samples must not be negative\n";
+                    return false;
+                }
+            } else if (name == "spp-map") {
+                opts.spp_map = value;
+            } else if (name == "checkpoint") {
+                opts.checkpoint = value;
+            } else if (name == "checkpoint-interval") {
+                opts.checkpoint_interval = std::stod(value);
+                if (opts.checkpoint_interval < 0) {
+                    err << "--checkpoint-interval must not be negative\n";
+                    return false;
+                }
+            } else if (name == "resume") {
+                opts.resume = value;
+            } else if (name == "stream") {
+                opts.stream = value;
+            } else if (name == "telemetry") {
+                opts.telemetry = value;
+            } else if (name == "telemetry-interval") {
+                opts.telemetry_interval = std::stod(value);
+                if (opts.telemetry_interval <= 0) {
+                    err << "--telemetry-interval must be positive\n";
+                    return false;
+                }
+            } else if (name == "coordinator") {
+                opts.coordinator_port = std::stoi(value);
+                if (opts.coordinator_port < 0 || opts.coordinator_port > 65535) {
+                    err << "--coordinator must be a port from 0 to 65535\n";
+                    return false;
+                }
+            } else if (name == "local-workers") {
+                opts.local_workers = std::stoi(value);
+                if (opts.local_workers < 0) {
+                    err << "--local-workers must not be negative\n";
+                    return false;
+                }
+            } else if (name == "worker") {
+                opts.worker = value;
+            } else if (name == "tile-size") {
+                opts.tile_size = std::stoi(value);
+                if (opts.tile_size < 0) {
+                    err << "--tile-size must not be negative\n";
+                    return false;
+                }
+            } else if (name == "numa") {
+                if (value == "off") {
+                    opts.numa = numa_mode::off;
+                } else if (value == "pin") {
+                    opts.numa = numa_mode::pin;
+                } else if (value == "replicate") {
+                    opts.numa = numa_mode::replicate;
+                } else {
+                    err << "--numa must be off, pin or replicate\n";
+                    return false;
+                }
+            } else if (name == "numa-nodes") {
+                opts.numa_nodes = std::stoi(value);
+                if (opts.numa_nodes < 0) {
+                    err << "--numa-nodes must not be negative\n";
+                    return false;
+                }
+            } else if (name == "numa-bench") {
+                if (value != "on" && value != "off") {
+                    err << "--numa-bench must be on or off\n";
+                    return false;
+                }
+                opts.numa_bench = value == "on";
+            } else if (name == "sampler-bench") {
+                if (value != "on" && value != "off") {
+                    err << "--sampler-bench must be on or off\n";
+                    return false;
+                }
+                opts.sampler_bench = value == "on";
+            } else if (name == "tile-order") {
+                if (value == "hilbert") {
+                    opts.tiling = tile_order::hilbert;
+                } else if (value == "morton") {
+                    opts.tiling = tile_order::morton;
+                } else if (value == "rows") {
+                    opts.tiling = tile_order::rows;
+                } else {
+                    err << "--tile-order must be hilbert, morton or rows\n";
+                    return false;
+                }
+            } else if (name == "wavefront") {
+                opts.wavefront_size = std::stoi(value);
+                if (opts.wavefront_size < 0) {
+                    err << "--wavefront must not be negative\n";
+                    return false;
+                }
+            } else if (name == "packets") {
+                if (value == "off") {
+                    opts.packet_size = 0;
+                } else if (value == "8" || value == "16") {
+                    opts.packet_size = std::stoi(value);
+                } else {
+                    err << "--packets must be off, 8 or 16\n";
+                    return false;
+                }
+            } else if (name == "split-budget") {
+                opts.bvh.spatial_split_budget = std::stod(value);
+                if (opts.bvh.spatial_split_budget < 0) {
+                    err << "--split-budget must not be negative\n";
+                    return false;
+                }
+            } else if (name == "leaf-size") {
+                opts.bvh.max_leaf_size = std::stoi(value);
+                if (opts.bvh.max_leaf_size < 1 || opts.bvh.max_leaf_size > bvh_max_leaf_size) {
+                    err << "--leaf-size must be from 1 to " << bvh_max_leaf_size << "\n";
+                    return false;
+                }
+            } else {
+                err << "Unknown option \"--" << name << "\"\n";
+                print_usage(err, argv[0]);
+                return false;
+            }
+        } catch (const std::exception& e) {
+            err << "Could not parse value \"" << value << "\" for option \"--" << name << "\"\n";
+            return false;
+        }
+    }
+
+    if (opts.frames > 1 && opts.scene != scene_type::obj) {
+        err << "--frames only animates --scene=obj\n";
+        return false;
+    }
+
+    if (opts.coordinator_port >= 0 || !opts.worker.empty()) {
+        if (opts.coordinator_port >= 0 && !opts.worker.empty()) {
+            err << "--coordinator and --worker exclude each other\n";
+            return false;
+        }
+        // workers render every tile from the start, their samples would land on top of the resumed ones
+        if (!opts.resume.empty()) {
+            err << "--resume does not work with distributed rendering\n";
+            return false;
+        }
+        // the counters belong to local render threads, workers would all write to the same path
+        if (!opts.telemetry.empty()) {
+            err << "--telemetry does not work with distributed rendering\n";
+            return false;
+        }
+        // every worker builds the scene itself, a random one would differ in every process
+        if (opts.scene == scene_type::moving) {
+            err << "--scene=moving is random, it cannot be rendered distributed\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif //OPTIONS_H
@@ -0,0 +1,42 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <vector>
+
+// number of threads to use when a setting of 0 means "all of them"
+inline int resolve_thread_count(int requested) {
+    if (requested > 0) return requested;
+    int hw = static_cast<int>(std::thread::hardware_concurrency());
+    return hw > 0 ? hw : 1;
+}
+
+/*
+ * Split [begin, end) into at most n_chunks contiguous chunks and run
+ * f(chunk, chunk_begin, chunk_end) on each, one thread per chunk.
+ * The calling thread runs the first chunk itself, returns the number of chunks used.
+ */
+template<typename F>
+int parallel_for_chunks(int begin, int end, int n_chunks, F f) {
+    int span = end - begin;
+    n_chunks = std::max(1, std::min(n_chunks, span));
+
+    std::vector<std::future<void>> futures;
+    futures.reserve(n_chunks - 1);
+
+    for (int c = 1; c < n_chunks; c++) {
+        int b = begin + static_cast<int>(static_cast<long long>(span) * c / n_chunks);
+        int e = begin + static_cast<int>(static_cast<long long>(span) * (c + 1) / n_chunks);
+        futures.push_back(std::async(std::launch::async, f, c, b, e));
+    }
+
+    f(0, begin, begin + static_cast<int>(static_cast<long long>(span) / n_chunks));
+
+    for (auto& fut : futures) fut.get();
+
+    return n_chunks;
+}
+
+#endif //PARALLEL_H
@@ -0,0 +1,64 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <cstdint>
+
+#include "utility.hpp"
+#include "ray.hpp"
+
+/*
+ * Up to max_size rays traced together through a BVH, meant for camera rays
+ * of neighbouring samples that visit mostly the same nodes.
+ * Every lane keeps its own closest hit distance in t_max, lowered as hits are found.
+ * Origins, reciprocal directions and t_max are also kept as float structure of
+ * arrays so a node box is tested against 8 lanes with one SIMD kernel.
+ */
+struct alignas(32) ray_packet {
+    static constexpr int max_size = 16;
+
+    float orig[3][max_size];
+    float inv_dir[3][max_size];
+    float t_max_f[max_size];
+
+    ray rays[max_size];
+    Float t_max[max_size];
+    bool hit[max_size];
+    int size = 0;
+
+    // unused lanes are zeroed once, so the SIMD kernels never read uninitialized floats
+    ray_packet() {
+        for (int a = 0; a < 3; a++) {
+            for (int i = 0; i < max_size; i++) {
+                orig[a][i] = 0;
+                inv_dir[a][i] = 0;
+            }
+        }
+        for (int i = 0; i < max_size; i++) t_max_f[i] = 0;
+    }
+
+    void clear() { size = 0; }
+
+    // bit i is set for every lane in use
+    uint32_t lanes() const { return (1u << size) - 1; }
+
+    void add(const ray& r, Float t_max) {
+        int i = size++;
+        rays[i] = r;
+        this->t_max[i] = t_max;
+        t_max_f[i] = static_cast<float>(t_max);
+        hit[i] = false;
+        for (int a = 0; a < 3; a++) {
+            orig[a][i] = static_cast<float>(r.orig[a]);
+            inv_dir[a][i] = static_cast<float>(1 / r.dir[a]);
+        }
+    }
+
+    // lane i found a hit at distance t, closer than its t_max
+    void record_hit(int i, Float t) {
+        hit[i] = true;
+        t_max[i] = t;
+        t_max_f[i] = static_cast<float>(t);
+    }
+};
+
+#endif //RAY_PACKET_H
@@ -7,6 +7,8 @@
 #include "sphere.hpp"
 #include "moving_sphere.hpp"
 #include "triangle.hpp"
+#include "instance.hpp"
+#include "transform.hpp"
 #include "parse_tri_mesh.hpp"
 
 hittable_list random_scene() {
@@ -231,19 +233,100 @@ std::vector<shared_ptr<triangle>> test_tri_mesh(shared_ptr<material> mat_ptr) {
     return vec;
 }
 
+// material of the mesh in test_obj_file
+shared_ptr<material> test_obj_material() {
+    return make_shared<lambertian>(color(0.8,0.05,0.1));
+}
+
+// the scene of test_obj_file around an already loaded mesh
+hittable_list test_mesh_scene(const std::vector<shared_ptr<triangle>>& tris) {
+    hittable_list world;
+
+    auto ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    world.add(make_shared<sphere>(point3(0,-501,0), 500, ground));
+
+    for (const auto& h : tris) world.add(h);
+
+    return world;
+}
+
 hittable_list test_obj_file(const std::string& filename, std::ostream& log) {
+    return test_mesh_scene(build_mesh(filename, test_obj_material(), log));
+}
+
+// mesh of the first triangle in world, nullptr if there is none
+shared_ptr<TriangleMesh> first_mesh(const hittable_list& world) {
+    for (const auto& o : world.objects) {
+        auto tri = std::dynamic_pointer_cast<triangle>(o);
+        if (tri) return tri->mesh;
+    }
+    return nullptr;
+}
+
+/*
+ * n_instances copies of one bottom level structure on a grid, each with its own
+ * rotation and scale, every fourth one moving upwards for motion blur.
+ * The copies share blas, so memory does not grow with the number of instances.
+ */
+hittable_list instance_grid(shared_ptr<hittable> blas, int n_instances, std::ostream& log) {
     hittable_list world;
 
     auto ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
     world.add(make_shared<sphere>(point3(0,-501,0), 500, ground));
 
-    auto rose_mirror = make_shared<metal>(color(1.0,0.8,0.9));
-    auto red = make_shared<lambertian>(color(0.8,0.05,0.1));
-    std::vector<shared_ptr<triangle>> v = build_mesh(filename, red, log);
+    aabb box;
+    if (!blas->bounding_box(0, 1, box) || box.is_empty()) {
+        log << "\tError: bottom level structure has no bounding box, no instances placed\n";
+        return world;
+    }
+
+    // fit the object into a unit cell centered at the origin
+    vec3 extent = box.diagonal();
+    Float size = fmax(extent.x, fmax(extent.y, extent.z));
+    transform fit = scale(0.8 / size) * translate(-box.centroid());
 
-    for (const auto& h : v) world.add(h);
+    const int side = static_cast<int>(ceil(sqrt(static_cast<Float>(n_instances))));
+    const Float spacing = 1.0;
+
+    for (int i = 0; i < n_instances; i++) {
+        Float s = random_Float(0.6, 1.0);
+        Float x = (i % side - 0.5 * (side - 1)) * spacing;
+        Float z = -(i / side) * spacing;
+        // rest the scaled object on the ground at y = -1
+        Float y = -1 + 0.5 * s * 0.8 * extent.y / size;
+
+        transform object_to_world = translate(vec3(x, y, z)) * rotate(random_Float(0, 360), vec3(0, 1, 0))
+            * scale(s) * fit;
+
+        if (i % 4 == 3) {
+            world.add(make_shared<instance>(blas, object_to_world, vec3(0, random_Float(0, 0.2), 0)));
+        } else {
+            world.add(make_shared<instance>(blas, object_to_world));
+        }
+    }
+
+    log << "\tPlaced " << n_instances << " instances on a " << side << "x" << side << " grid\n";
 
     return world;
 }
 
+/*
+ * Deform a mesh for one frame of an animation. Vertices are twisted around the
+ * y axis by an angle that grows with the frame and pushed out by a wave travelling
+ * up the mesh. rest holds the undeformed positions, the topology never changes.
+ */
+void twist_mesh(TriangleMesh& mesh, const std::vector<point3>& rest, int frame) {
+    const Float twist = 0.05 * frame;
+    const Float phase = 0.5 * frame;
+
+    for (int i = 0; i < mesh.nVertices; i++) {
+        const point3& p = rest[i];
+        Float angle = twist * p.y;
+        Float s = 1 + 0.1 * sin(4 * p.y + phase);
+        Float x = s * (p.x * cos(angle) - p.z * sin(angle));
+        Float z = s * (p.x * sin(angle) + p.z * cos(angle));
+        mesh.p[i] = point3(x, p.y, z);
+    }
+}
+
 #endif // SCENES_H
\ No newline at end of file
@@ -0,0 +1,166 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <iostream>
+
+#include "utility.hpp"
+#include "timing.hpp"
+
+/*
+ * Random numbers of one render thread, passed down the render path instead of
+ * the thread_local generator behind random_Float. The engine is xoshiro256+,
+ * four words of state and a few adds, shifts and rotates per number, and floats
+ * are made from the top 53 bits, 24 for single precision, without a distribution object.
+ * The mappings to the sphere, hemisphere, disk and triangle are closed form,
+ * so they take a fixed count of numbers and never loop.
+ * https://prng.di.unimi.it/
+ */
+class sampler {
+    public:
+        // every seed gives its own sequence, splitmix64 spreads it over the state
+        explicit sampler(uint64_t seed);
+
+        // seeded from the clock and the calling thread, as random_Float is
+        static sampler for_this_thread();
+
+        uint64_t next();
+
+        // uniform in [0, 1). A float cannot hold 53 bits, rounding could give exactly 1,
+        // so it takes as many bits as its mantissa has
+        Float uniform() {
+            if constexpr (sizeof(Float) == 4) return static_cast<Float>(next() >> 40) * 0x1.0p-24f;
+            else return static_cast<Float>(next() >> 11) * 0x1.0p-53;
+        }
+
+        // uniform in [min, max)
+        Float uniform(Float min, Float max) { return min + (max - min) * uniform(); }
+
+        // uniform on the unit sphere
+        vec3 unit_vector();
+
+        // uniform in the unit ball
+        vec3 in_unit_sphere();
+
+        // uniform in the half of the unit ball on the side normal points to
+        vec3 in_hemisphere(const vec3& normal);
+
+        // uniform in the unit disk in the xy plane
+        vec3 in_unit_disk();
+
+        // uniform in the triangle p0, p1, p2
+        point3 in_triangle(const point3& p0, const point3& p1, const point3& p2);
+
+    private:
+        uint64_t s[4];
+
+        static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+sampler::sampler(uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        s[i] = z ^ (z >> 31);
+    }
+}
+
+sampler sampler::for_this_thread() {
+    return sampler(std::chrono::high_resolution_clock::now().time_since_epoch().count()
+        + static_cast<uint64_t>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+}
+
+inline uint64_t sampler::next() {
+    const uint64_t result = s[0] + s[3];
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+inline vec3 sampler::unit_vector() {
+    // z is uniform on a sphere, the height of a slice is proportional to its area
+    Float z = 1 - 2 * uniform();
+    Float r = std::sqrt(std::max(Float(0), 1 - z * z));
+    Float phi = 2 * pi * uniform();
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+inline vec3 sampler::in_unit_sphere() {
+    // the volume inside radius r grows with r cubed
+    return std::cbrt(uniform()) * unit_vector();
+}
+
+inline vec3 sampler::in_hemisphere(const vec3& normal) {
+    vec3 v = in_unit_sphere();
+    return dot(v, normal) > 0.0 ? v : -v;
+}
+
+inline vec3 sampler::in_unit_disk() {
+    // the area inside radius r grows with r squared
+    Float r = std::sqrt(uniform());
+    Float phi = 2 * pi * uniform();
+    return vec3(r * std::cos(phi), r * std::sin(phi), 0);
+}
+
+inline point3 sampler::in_triangle(const point3& p0, const point3& p1, const point3& p2) {
+    // points of the parallelogram outside the triangle are folded back into it
+    Float u = uniform();
+    Float v = uniform();
+    if (u + v > 1.0) {
+        u = 1 - u;
+        v = 1 - v;
+    }
+    return p0 + u * (p1 - p0) + v * (p2 - p0);
+}
+
+/*
+ * Log samples per second of random_Float and the rejection sampled vec3 functions
+ * next to the sampler doing the same. Every result is summed into a value
+ * that is logged, so the compiler cannot drop the loops.
+ */
+void sampler_benchmark(std::ostream& log, long long n = 20000000) {
+    sampler rng = sampler::for_this_thread();
+    point3 p0(1, 0.5, 0), p1(-1, 0.5, 0), p2(0, -1, 0);
+    vec3 normal(0, 1, 0);
+    Float sink = 0;
+
+    auto run = [&](const char* name, auto f) {
+        Timer t;
+        t.start();
+        for (long long i = 0; i < n; i++) sink += f();
+        long long micro = std::max(t.elapsedMicro(), 1ll);
+        log << "\t\t" << name << ": " << static_cast<Float>(n) / micro << " million per second\n";
+        return static_cast<Float>(n) / micro;
+    };
+
+    auto compare = [&](const char* what, auto old_f, auto new_f) {
+        log << "\t" << what << "\n";
+        Float before = run("current", old_f);
+        Float after = run("sampler", new_f);
+        log << "\t\tspeedup " << after / before << "x\n";
+    };
+
+    log << "[Sampler Benchmark] " << n << " samples each\n";
+    compare("uniform Float", []() { return random_Float(); }, [&]() { return rng.uniform(); });
+    compare("unit sphere", []() { return random_in_unit_sphere().x; }, [&]() { return rng.in_unit_sphere().x; });
+    compare("unit vector", []() { return random_unit_vector().x; }, [&]() { return rng.unit_vector().x; });
+    compare("hemisphere", [&]() { return random_in_hemisphere(normal).y; }, [&]() { return rng.in_hemisphere(normal).y; });
+    compare("unit disk", []() { return random_in_unit_disk().x; }, [&]() { return rng.in_unit_disk().x; });
+    compare("triangle", [&]() { return random_in_triangle(p0, p1, p2).x; }, [&]() { return rng.in_triangle(p0, p1, p2).x; });
+    log << "\t(checksum " << sink << ")\n";
+    log << "[/Sampler Benchmark]\n\n" << std::flush;
+}
+
+#endif //SAMPLER_H
@@ -0,0 +1,35 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <mutex>
+
+/*
+ * Traversal counters. Each thread counts into its own thread_local copy
+ * and adds it to the global totals once it finishes, so the hot loops
+ * never write to shared memory.
+ */
+struct ray_stats {
+    long long rays = 0;
+    long long nodes_visited = 0;
+    long long primitive_tests = 0;
+
+    void operator+=(const ray_stats& s) {
+        rays += s.rays;
+        nodes_visited += s.nodes_visited;
+        primitive_tests += s.primitive_tests;
+    }
+};
+
+thread_local ray_stats thread_ray_stats;
+
+std::mutex ray_stats_mtx;
+ray_stats total_ray_stats;
+
+// add this thread's counts to the totals and reset them
+void flush_thread_ray_stats() {
+    std::lock_guard<std::mutex> lock(ray_stats_mtx);
+    total_ray_stats += thread_ray_stats;
+    thread_ray_stats = ray_stats();
+}
+
+#endif //STATS_H
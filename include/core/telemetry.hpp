@@ -0,0 +1,251 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utility.hpp"
+
+inline long long telemetry_clock_micro() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Counters of one render thread, written only by that thread after every tile
+ * and read by the reporter, so relaxed atomics are all the synchronization needed.
+ * A cache line each, threads never share one.
+ * Primary rays are the camera rays, one per sample, secondary rays all bounces after them.
+ */
+struct alignas(64) thread_counters {
+    std::atomic<long long> primary_rays{ 0 };
+    std::atomic<long long> secondary_rays{ 0 };
+    std::atomic<long long> tiles{ 0 };
+    std::atomic<long long> busy_micro{ 0 };
+
+    // clock when the tile being rendered started, 0 while the thread is between tiles
+    std::atomic<long long> tile_start{ 0 };
+};
+
+/*
+ * Live telemetry of a render: every interval seconds a reporter thread writes one JSON line
+ * with the ray rates, the samples done and planned, an ETA and per thread the tiles done,
+ * the busy fraction since the last line and how long the current tile has been running,
+ * which shows stalled threads and straggling tiles. The last line has "done": true.
+ * Lines go to a file, or with a path of unix:<socket> to a listening unix domain socket.
+ */
+class render_telemetry {
+    public:
+        explicit render_telemetry(int n_threads)
+            : n_threads{ n_threads }, counters(new thread_counters[n_threads]) {}
+
+        ~render_telemetry() { close(); }
+
+        int threads() const { return n_threads; }
+
+        thread_counters& thread(int i) { return counters[i]; }
+
+        // start reporting, false with the reason in err if path cannot be opened
+        bool open(const std::string& path, Float interval, std::ostream& err);
+
+        // samples the render plans in total and already had when it started, and the time budget
+        // in seconds if any, the ETA never goes past it. Only before open, the reporter reads them
+        void set_plan(long long planned_samples, long long resumed_samples, Float time_budget);
+
+        void set_pass(int pass) { current_pass.store(pass, std::memory_order_relaxed); }
+
+        // write the final line and stop the reporter
+        void close();
+
+    private:
+        const int n_threads;
+        std::unique_ptr<thread_counters[]> counters;
+
+        int fd = -1;
+        bool is_socket = false;
+        long long interval_micro = 1000000;
+
+        // set before the reporter starts, only the pass changes while it runs
+        long long planned = 0;
+        long long resumed = 0;
+        Float budget_seconds = 0;
+        std::atomic<int> current_pass{ 0 };
+
+        std::thread reporter;
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool stopping = false;
+
+        // state of the previous line, only touched by the reporter
+        long long start_time = 0, last_time = 0, last_samples = 0, last_rays = 0;
+        Float sample_rate = 0;
+        bool has_rate = false;
+        std::vector<long long> last_busy;
+
+        void run();
+        std::string report_line(bool done);
+        void write_line(const std::string& line);
+};
+
+bool render_telemetry::open(const std::string& path, Float interval, std::ostream& err) {
+    if (path.rfind("unix:", 0) == 0) {
+        std::string socket_path = path.substr(5);
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path)) {
+            err << "Telemetry socket path " << socket_path << " is too long\n";
+            return false;
+        }
+        std::strcpy(addr.sun_path, socket_path.c_str());
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            err << "Could not connect to telemetry socket " << socket_path << "\n";
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            return false;
+        }
+        is_socket = true;
+    } else {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            err << "Could not open telemetry file " << path << "\n";
+            return false;
+        }
+    }
+
+    interval_micro = std::max(1ll, static_cast<long long>(interval * 1e6));
+    start_time = last_time = telemetry_clock_micro();
+    last_busy.assign(n_threads, 0);
+    reporter = std::thread(&render_telemetry::run, this);
+    return true;
+}
+
+void render_telemetry::set_plan(long long planned_samples, long long resumed_samples, Float time_budget) {
+    planned = planned_samples;
+    resumed = resumed_samples;
+    budget_seconds = time_budget;
+
+    // samples of a resumed image were not rendered by this run, the rate starts from them
+    last_samples = resumed_samples;
+}
+
+void render_telemetry::close() {
+    if (!reporter.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_one();
+    reporter.join();
+
+    write_line(report_line(true));
+    ::close(fd);
+    fd = -1;
+}
+
+void render_telemetry::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!cv.wait_for(lock, std::chrono::microseconds(interval_micro), [&]() { return stopping; }))
+        write_line(report_line(false));
+}
+
+std::string render_telemetry::report_line(bool done) {
+    long long now = telemetry_clock_micro();
+    Float elapsed = (now - start_time) * 1e-6;
+    Float since_last = std::max(now - last_time, 1ll) * 1e-6;
+
+    long long primary = 0, secondary = 0, tiles = 0;
+    for (int i = 0; i < n_threads; i++) {
+        primary += counters[i].primary_rays.load(std::memory_order_relaxed);
+        secondary += counters[i].secondary_rays.load(std::memory_order_relaxed);
+        tiles += counters[i].tiles.load(std::memory_order_relaxed);
+    }
+
+    // one camera ray per sample, so the primary rays count the samples done
+    long long samples = resumed + primary;
+    long long total = planned;
+    long long rays = primary + secondary;
+
+    // the sample rate is smoothed over the last few lines, single passes make it jumpy.
+    // It starts from the first line that saw samples finish, before that there is no rate
+    Float rate = (samples - last_samples) / since_last;
+    if (has_rate) {
+        sample_rate = 0.7 * sample_rate + 0.3 * rate;
+    } else if (samples > last_samples) {
+        sample_rate = rate;
+        has_rate = true;
+    }
+
+    Float eta = -1;
+    if (!done && sample_rate > 0 && total > 0) {
+        eta = std::max(Float(0), (total - samples) / sample_rate);
+        if (budget_seconds > 0) eta = std::min(eta, std::max(Float(0), budget_seconds - elapsed));
+    }
+
+    std::ostringstream line;
+    line << "{\"time\": " << elapsed
+        << ", \"done\": " << (done ? "true" : "false")
+        << ", \"pass\": " << current_pass.load(std::memory_order_relaxed)
+        << ", \"samples\": " << samples
+        << ", \"planned_samples\": " << total
+        << ", \"progress\": " << (total > 0 ? std::min(Float(1), static_cast<Float>(samples) / total) : 0)
+        << ", \"eta\": " << eta
+        << ", \"primary_rays\": " << primary
+        << ", \"secondary_rays\": " << secondary
+        << ", \"rays_per_second\": " << (rays - last_rays) / since_last
+        << ", \"tiles\": " << tiles
+        << ", \"threads\": [";
+
+    for (int i = 0; i < n_threads; i++) {
+        const thread_counters& c = counters[i];
+        long long busy = c.busy_micro.load(std::memory_order_relaxed);
+        long long tile_start = c.tile_start.load(std::memory_order_relaxed);
+
+        // time in the running tile counts as busy, even though it is only added when the tile ends
+        long long in_tile = tile_start > 0 ? std::max(0ll, now - tile_start) : 0;
+        Float utilization = std::min(Float(1), (busy + in_tile - last_busy[i]) * 1e-6 / since_last);
+        last_busy[i] = busy + in_tile;
+
+        line << (i ? ", " : "") << "{\"thread\": " << i
+            << ", \"tiles\": " << c.tiles.load(std::memory_order_relaxed)
+            << ", \"rays\": " << c.primary_rays.load(std::memory_order_relaxed) + c.secondary_rays.load(std::memory_order_relaxed)
+            << ", \"utilization\": " << std::max(Float(0), utilization)
+            << ", \"tile_seconds\": " << in_tile * 1e-6 << "}";
+    }
+    line << "]}\n";
+
+    last_time = now;
+    last_samples = samples;
+    last_rays = rays;
+    return line.str();
+}
+
+void render_telemetry::write_line(const std::string& line) {
+    const char* p = line.data();
+    size_t left = line.size();
+    while (left > 0) {
+        ssize_t n = is_socket ? send(fd, p, left, MSG_NOSIGNAL) : ::write(fd, p, left);
+        // a watcher that went away only ends the telemetry, never the render
+        if (n <= 0) return;
+        p += n;
+        left -= n;
+    }
+}
+
+#endif //TELEMETRY_H
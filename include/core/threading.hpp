@@ -10,73 +10,338 @@
 
 #include <thread>
 #include <future>
-#include <queue>
-#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdint>
 
 #include "utility.hpp"
 #include "hittable.hpp"
+#include "ray_packet.hpp"
 #include "camera.hpp"
 #include "color.hpp"
+#include "film.hpp"
+#include "wavefront.hpp"
+#include "numa.hpp"
+#include "tile_stream.hpp"
+#include "telemetry.hpp"
+#include "stats.hpp"
+#include "parallel.hpp"
+#include "timing.hpp"
 
 //use from writing to cout from threads
 //std::mutex cout_mtx
 
-//use for operating on pixel block queue
-std::mutex q_mtx;
-
 template<typename T>
 bool future_is_ready(std::future<T>& t) {
     return t.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
 }
 
-void thread_render(std::queue<int *>& q, vec3 * pixels, int image_width, int image_height, 
-        const hittable& world, const camera& cam, int MSAA_samples_per_pixel, int MC_samples_per_pixel,
-        int MSAA_subpixel_width, Float MSAA_subpixel_size, int max_depth) {
-    bool cont;
-    int * arr;
-
-    //attempt to take an array to process
-    q_mtx.lock();
-    cont = (q.size() > 0);
-    if (cont) {
-        arr = q.front();
-        q.pop();
+/*
+ * Hands out the tiles of a preallocated array to the render threads.
+ * Taking a tile is one atomic increment of the next index, so threads
+ * never lock or allocate per tile. Finished tiles are counted separately
+ * for progress reports.
+ */
+class tile_scheduler {
+    public:
+        tile_scheduler(std::vector<pixel_tile> tiles) : tiles{ std::move(tiles) } {}
+
+        // false once every tile has been handed out
+        bool next(pixel_tile& tile) {
+            size_t i = next_tile.fetch_add(1, std::memory_order_relaxed);
+            if (i >= tiles.size()) return false;
+            tile = tiles[i];
+            return true;
+        }
+
+        void finished() { n_finished.fetch_add(1, std::memory_order_relaxed); }
+
+        size_t size() const { return tiles.size(); }
+
+        size_t remaining() const { return tiles.size() - n_finished.load(std::memory_order_relaxed); }
+
+        // hand out every tile again, only while no thread is taking tiles
+        void reset() {
+            next_tile.store(0);
+            n_finished.store(0);
+        }
+
+    private:
+        const std::vector<pixel_tile> tiles;
+        std::atomic<size_t> next_tile{ 0 };
+        std::atomic<size_t> n_finished{ 0 };
+};
+
+// image and sampling setup every render thread works with
+struct render_settings {
+    int image_width;
+    int image_height;
+    int MSAA_samples_per_pixel;
+    int MSAA_subpixel_width;
+    Float MSAA_subpixel_size;
+    int max_depth;
+
+    // camera rays traced together, 8 or 16, 0 traces every ray on its own
+    int packet_size = 0;
+
+    // paths traced together by the wavefront integrator, 0 uses the recursive ray_color
+    int wavefront_size = 0;
+};
+
+/*
+ * Camera ray for sample k of pixel (i, j). Consecutive samples cycle through
+ * the MSAA subpixels, so any run of MSAA_samples_per_pixel samples is stratified.
+ */
+ray pixel_sample_ray(const camera& cam, int i, int j, int k, const render_settings& rs, sampler& rng) {
+    int m = k % rs.MSAA_samples_per_pixel;
+
+    //use stratified sampling + jitter to emulate blue noise for MSAA
+    Float u = static_cast<Float>(i + rs.MSAA_subpixel_size * (m % rs.MSAA_subpixel_width + rng.uniform(-0.5, 0.5))) / (rs.image_width - 1);
+    Float v = static_cast<Float>(j + rs.MSAA_subpixel_size * (m / rs.MSAA_subpixel_width + rng.uniform(-0.5, 0.5))) / (rs.image_height - 1);
+
+    return cam.get_ray(u, v, rng);
+}
+
+/*
+ * Add n_samples to every active pixel in tile with the camera rays traced rs.packet_size at a time.
+ * Samples are packed in pixel order, so a packet holds samples of one pixel
+ * or of a few neighbouring ones. Samples are numbered on from the counts of image
+ * and added to out, which is image unless thread_render was given a buffer.
+ */
+void render_block_packets(const pixel_tile& tile, const film& image, film& out, const hittable& world, const camera& cam,
+        const render_settings& rs, int n_samples, const std::vector<uint8_t>* active, sampler& rng) {
+    ray_packet packet;
+    int lane_pixel[ray_packet::max_size];
+    color lane_color[ray_packet::max_size];
+
+    auto trace = [&]() {
+        ray_color_packet(packet, world, rs.max_depth, lane_color, rng);
+        for (int k = 0; k < packet.size; k++)
+            out.add_sample(lane_pixel[k], lane_color[k]);
+        packet.clear();
+    };
+
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            int pixel = j * rs.image_width + i;
+            if (active && !(*active)[pixel]) continue;
+
+            // samples of this pixel still in the packet are not counted yet
+            int first_sample = image.sample_count(pixel);
+            for (int k = first_sample; k < first_sample + n_samples; k++) {
+                lane_pixel[packet.size] = pixel;
+                packet.add(pixel_sample_ray(cam, i, j, k, rs, rng), infinity);
+
+                if (packet.size == rs.packet_size) trace();
+            }
+        }
     }
-    q_mtx.unlock();
-
-    // continue if we got an array to process
-    while(cont) {
-        //do processing
-        for (int j = arr[2]; j < arr[3]; j++) {
-            for (int i = arr[0]; i < arr[1]; i++) {
-                color pixel_color(0, 0, 0);
-
-                for (int s = 0; s < MC_samples_per_pixel; s++) {
-                    for (int m = 0; m < MSAA_samples_per_pixel; m++) {
-                        //use stratified sampling + jitter to emulate blue noise for MSAA
-                        Float u = static_cast<Float>(i + MSAA_subpixel_size * (m % MSAA_subpixel_width + random_Float(-0.5, 0.5))) / (image_width - 1);
-                        Float v = static_cast<Float>(j + MSAA_subpixel_size * (m / MSAA_subpixel_width + random_Float(-0.5, 0.5))) / (image_height - 1);
-
-                        ray r = cam.get_ray(u, v);
-                        pixel_color += ray_color(r, world, max_depth);
+
+    if (packet.size > 0) trace();
+}
+
+/*
+ * Add n_samples to every active pixel in tile with the wavefront integrator,
+ * generating up to rs.wavefront_size paths at a time into wf. Samples are
+ * numbered and added as in render_block_packets.
+ */
+void render_block_wavefront(const pixel_tile& tile, const film& image, film& out, const hittable& world, const camera& cam,
+        const render_settings& rs, int n_samples, const std::vector<uint8_t>* active, wavefront& wf, sampler& rng) {
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            int pixel = j * rs.image_width + i;
+            if (active && !(*active)[pixel]) continue;
+
+            // samples of this pixel still in the batch are not counted yet
+            int first_sample = image.sample_count(pixel);
+            for (int k = first_sample; k < first_sample + n_samples; k++) {
+                wf.paths.push(pixel, pixel_sample_ray(cam, i, j, k, rs, rng), color(1.0), color(0.0));
+
+                if (wf.paths.size() == rs.wavefront_size) wf.trace(world, rs.max_depth, out, rng);
+            }
+        }
+    }
+
+    if (wf.paths.size() > 0) wf.trace(world, rs.max_depth, out, rng);
+}
+
+/*
+ * Add n_samples to every pixel into image, or only to the pixels set in active if given,
+ * taking tiles until none are left. Every pixel continues its own sample sequence.
+ * If pixel_stats is given, the traversal counters of every pixel are added there,
+ * it needs single rays, so rs.packet_size and rs.wavefront_size must be 0.
+ * If buffer is given the samples go there instead of into image, which is then only read.
+ * If stream is given every finished tile is queued on it
+ * If counters are given the rays, tiles and busy time of every finished tile are added there
+ */
+void thread_render(tile_scheduler& tiles, film& image, const hittable& world, const camera& cam,
+        const render_settings& rs, int n_samples, const std::vector<uint8_t>* active = nullptr,
+        ray_stats* pixel_stats = nullptr, film* buffer = nullptr, tile_stream_writer* stream = nullptr,
+        thread_counters* counters = nullptr) {
+    pixel_tile tile;
+    wavefront wf;
+    sampler rng = sampler::for_this_thread();
+    film& out = buffer ? *buffer : image;
+
+    while (tiles.next(tile)) {
+        long long tile_start = 0;
+        long long rays_before = thread_ray_stats.rays;
+        if (counters) {
+            tile_start = telemetry_clock_micro();
+            counters->tile_start.store(tile_start, std::memory_order_relaxed);
+        }
+
+        if (rs.wavefront_size > 0) {
+            render_block_wavefront(tile, image, out, world, cam, rs, n_samples, active, wf, rng);
+        } else if (rs.packet_size > 0) {
+            render_block_packets(tile, image, out, world, cam, rs, n_samples, active, rng);
+        } else {
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    int pixel = j * rs.image_width + i;
+                    if (active && !(*active)[pixel]) continue;
+
+                    ray_stats before = thread_ray_stats;
+                    int first_sample = image.sample_count(pixel);
+
+                    for (int k = first_sample; k < first_sample + n_samples; k++)
+                        out.add_sample(pixel, ray_color(pixel_sample_ray(cam, i, j, k, rs, rng), world, rs.max_depth, rng));
+
+                    if (pixel_stats) {
+                        ray_stats& ps = pixel_stats[pixel];
+                        ps.rays += thread_ray_stats.rays - before.rays;
+                        ps.nodes_visited += thread_ray_stats.nodes_visited - before.nodes_visited;
+                        ps.primitive_tests += thread_ray_stats.primitive_tests - before.primitive_tests;
                     }
                 }
-                pixels[j * image_width + i] = pixel_color;
             }
         }
-        
-        //array was new[] allocated, we must delete[]
-        delete[] arr;
-
-        //finished processing, look for new array to process
-        q_mtx.lock();
-        cont = (q.size() > 0);
-        if (cont) {
-            arr = q.front();
-            q.pop();
+
+        if (stream) stream->push(make_tile_update(tile, image, buffer));
+
+        if (counters) {
+            // one camera ray per sample of every active pixel, everything else was a bounce
+            long long pixels = static_cast<long long>(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+            if (active) {
+                pixels = 0;
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    for (int i = tile.x0; i < tile.x1; i++)
+                        pixels += (*active)[j * rs.image_width + i];
+                }
+            }
+            long long primary = pixels * n_samples;
+            long long rays = thread_ray_stats.rays - rays_before;
+
+            counters->primary_rays.fetch_add(primary, std::memory_order_relaxed);
+            counters->secondary_rays.fetch_add(std::max(0ll, rays - primary), std::memory_order_relaxed);
+            counters->busy_micro.fetch_add(telemetry_clock_micro() - tile_start, std::memory_order_relaxed);
+            counters->tiles.fetch_add(1, std::memory_order_relaxed);
+            counters->tile_start.store(0, std::memory_order_relaxed);
         }
-        q_mtx.unlock();
+
+        tiles.finished();
+    }
+
+    flush_thread_ray_stats();
+}
+
+/*
+ * Pilot for choose_tile_size: microseconds one camera sample takes on average,
+ * measured with one sample on every stride-th pixel in both directions.
+ * The samples are thrown away and left out of the ray statistics.
+ */
+Float pilot_sample_cost(const hittable& world, const camera& cam, const render_settings& rs, int stride = 8) {
+    ray_stats before = thread_ray_stats;
+    sampler rng = sampler::for_this_thread();
+    int n = 0;
+
+    Timer t;
+    t.start();
+    for (int j = stride / 2; j < rs.image_height; j += stride) {
+        for (int i = stride / 2; i < rs.image_width; i += stride, n++)
+            ray_color(pixel_sample_ray(cam, i, j, 0, rs, rng), world, rs.max_depth, rng);
+    }
+    long long micro = t.elapsedMicro();
+
+    thread_ray_stats = before;
+    return static_cast<Float>(std::max(micro, 1ll)) / std::max(n, 1);
+}
+
+/*
+ * Tile size for an image rendered by n_threads threads in passes of pass_samples,
+ * when one camera sample costs sample_micro microseconds.
+ * Tiles start at 8 pixels and double while a tile of a pass is quicker than
+ * min_tile_micro, so handing out and starting tiles stays a small part of the work,
+ * but never below tiles_per_thread tiles for every thread, so the threads still
+ * finish close together when tiles differ in cost.
+ */
+int choose_tile_size(int image_width, int image_height, int n_threads, int pass_samples, Float sample_micro) {
+    const int max_size = 128;
+    const int tiles_per_thread = 16;
+    const Float min_tile_micro = 1000;
+
+    int size = 8;
+    while (size < max_size) {
+        if (size * size * pass_samples * sample_micro >= min_tile_micro) break;
+
+        int next = 2 * size;
+        long long n_tiles = static_cast<long long>((image_width + next - 1) / next) * ((image_height + next - 1) / next);
+        if (n_tiles < static_cast<long long>(tiles_per_thread) * n_threads) break;
+
+        size = next;
+    }
+    return size;
+}
+
+/*
+ * Add n_samples to every pixel, or to the pixels set in active, with n_threads
+ * threads, writing the tiles left to progress until all threads are done.
+ * With a placement its threads are used instead, pinned to their cpus, each
+ * tracing its node's world into its node's buffer, merged into image at the end.
+ * With a stream, finished tiles are written out while the pass goes on,
+ * with telemetry thread i counts into its counters i
+ */
+void render_pass(tile_scheduler& tiles, film& image, const hittable& world, const camera& cam,
+        const render_settings& rs, int n_samples, const std::vector<uint8_t>* active, ray_stats* pixel_stats,
+        int n_threads, std::ostream& progress, render_placement* placement = nullptr,
+        tile_stream_writer* stream = nullptr, render_telemetry* telemetry = nullptr) {
+    tiles.reset();
+
+    if (placement) n_threads = placement->threads();
+
+    std::vector<std::future<void>> thread_futures(n_threads);
+    for (int i = 0; i < n_threads; i++) {
+        thread_counters* counters = telemetry && i < telemetry->threads() ? &telemetry->thread(i) : nullptr;
+        if (placement) {
+            int cpu = placement->cpu[i];
+            const hittable* node_world = placement->worlds[placement->node[i]];
+            film* buffer = placement->buffers[placement->node[i]].get();
+            thread_futures[i] = std::async(std::launch::async, [&, cpu, node_world, buffer, counters]() {
+                pin_current_thread(cpu);
+                thread_render(tiles, image, *node_world, cam, rs, n_samples, active, pixel_stats, buffer, stream, counters);
+            });
+        } else {
+            thread_futures[i] = std::async(std::launch::async, thread_render,
+                std::ref(tiles), std::ref(image), std::ref(world), std::ref(cam), std::ref(rs),
+                n_samples, active, pixel_stats, nullptr, stream, counters);
+        }
+    }
+
+    // the threads are done once every future is ready, even if one of them failed.
+    // Waiting on a future instead of sleeping returns as soon as a short pass is done
+    for (auto& f : thread_futures) {
+        while (f.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+            progress << "\rPixel blocks remaining: " << tiles.remaining() << "    " << std::flush;
+    }
+
+    progress << "\rPixel blocks remaining: " << 0 << "    " << std::flush;
+
+    for (auto& f : thread_futures) f.get();
+
+    if (placement) {
+        for (auto& buffer : placement->buffers)
+            image.take_samples(*buffer);
     }
 }
 
-#endif //THREADING_H
\ No newline at end of file
+#endif //THREADING_H
@@ -0,0 +1,162 @@
+#ifndef TILE_STREAM_H
+#define TILE_STREAM_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "utility.hpp"
+#include "color.hpp"
+#include "film.hpp"
+
+/*
+ * Tiles streamed out while the render goes on, so compositing can start before
+ * the frame is done. The stream is a header followed by one record per finished tile,
+ * a tile is sent again every pass that adds samples to it:
+ *   header   char magic[8] "RTTILES", uint32 version, int32 width, int32 height
+ *   record   int32 x0, x1, y0, y1, then float32 r, g, b of every pixel in the tile,
+ *            rows from y0 up, linear HDR means before gamma, y0 = 0 is the bottom row
+ *   end      a record with every coordinate -1 and no pixels once the frame is done
+ * Later records of a tile replace the earlier ones.
+ */
+const char tile_stream_magic[8] = { 'R', 'T', 'T', 'I', 'L', 'E', 'S', '\0' };
+const uint32_t tile_stream_version = 1;
+
+struct tile_update {
+    pixel_tile tile;
+    std::vector<float> rgb;
+};
+
+/*
+ * Mean color of every pixel of tile. If buffer is given it holds the samples of the
+ * current pass not yet merged into image, as with NUMA placement, and is counted in.
+ */
+tile_update make_tile_update(const pixel_tile& tile, const film& image, const film* buffer) {
+    tile_update u = { tile, {} };
+    u.rgb.reserve(3 * (tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+
+    for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+            int p = j * image.width + i;
+            color sum = image.pixel_sum(p);
+            int n = image.sample_count(p);
+            if (buffer) {
+                sum += buffer->pixel_sum(p);
+                n += buffer->sample_count(p);
+            }
+
+            color mean = sum / std::max(n, 1);
+            u.rgb.push_back(static_cast<float>(mean.x));
+            u.rgb.push_back(static_cast<float>(mean.y));
+            u.rgb.push_back(static_cast<float>(mean.z));
+        }
+    }
+    return u;
+}
+
+/*
+ * Writes tile updates to a file or pipe on its own thread. Render threads only
+ * queue them, so a slow disk or reader never stalls the render.
+ */
+class tile_stream_writer {
+    public:
+        long long tiles_written = 0;
+        long long bytes_written = 0;
+
+        ~tile_stream_writer() { close(); }
+
+        // open path, a file or a named pipe, and start the writer thread. False if it cannot be opened
+        bool open(const std::string& path, int width, int height);
+
+        void push(tile_update&& update);
+
+        // write what is queued and the end record, then stop the thread
+        void close();
+
+    private:
+        std::ofstream out;
+        std::thread writer;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<tile_update> queue;
+        bool closing = false;
+
+        void write_record(const tile_update& u);
+        void run();
+};
+
+bool tile_stream_writer::open(const std::string& path, int width, int height) {
+    out.open(path, std::ios::binary);
+    if (!out) return false;
+
+    int32_t size[2] = { width, height };
+    out.write(tile_stream_magic, sizeof(tile_stream_magic));
+    out.write(reinterpret_cast<const char*>(&tile_stream_version), sizeof(tile_stream_version));
+    out.write(reinterpret_cast<const char*>(size), sizeof(size));
+    out.flush();
+    bytes_written = sizeof(tile_stream_magic) + sizeof(tile_stream_version) + sizeof(size);
+
+    writer = std::thread(&tile_stream_writer::run, this);
+    return true;
+}
+
+void tile_stream_writer::push(tile_update&& update) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        queue.push_back(std::move(update));
+    }
+    cv.notify_one();
+}
+
+void tile_stream_writer::close() {
+    if (!writer.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        closing = true;
+    }
+    cv.notify_one();
+    writer.join();
+
+    write_record({ { -1, -1, -1, -1 }, {} });
+    out.close();
+}
+
+void tile_stream_writer::write_record(const tile_update& u) {
+    int32_t coords[4] = { u.tile.x0, u.tile.x1, u.tile.y0, u.tile.y1 };
+    out.write(reinterpret_cast<const char*>(coords), sizeof(coords));
+    out.write(reinterpret_cast<const char*>(u.rgb.data()), u.rgb.size() * sizeof(float));
+    bytes_written += sizeof(coords) + u.rgb.size() * sizeof(float);
+}
+
+void tile_stream_writer::run() {
+    std::deque<tile_update> batch;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&]() { return closing || !queue.empty(); });
+            if (queue.empty() && closing) return;
+            batch.swap(queue);
+        }
+
+        // the lock is released while writing, render threads keep queueing
+        for (const tile_update& u : batch) {
+            write_record(u);
+            tiles_written++;
+        }
+        batch.clear();
+
+        // readers of a pipe see every tile as soon as it is written
+        out.flush();
+    }
+}
+
+#endif //TILE_STREAM_H
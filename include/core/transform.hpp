@@ -0,0 +1,150 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+
+#include "utility.hpp"
+#include "aabb.hpp"
+
+/*
+ * Affine transform stored as a 4x4 matrix together with its inverse,
+ * so points, vectors and normals can be moved either way without inverting.
+ * Idea taken from pbrt: https://www.pbrt.org
+ */
+class transform {
+    public:
+        Float m[4][4];
+        Float m_inv[4][4];
+
+        // identity
+        transform() {
+            for (int i = 0; i < 4; i++)
+                for (int j = 0; j < 4; j++)
+                    m[i][j] = m_inv[i][j] = (i == j) ? 1 : 0;
+        }
+
+        transform(const Float mat[4][4], const Float mat_inv[4][4]) {
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    m[i][j] = mat[i][j];
+                    m_inv[i][j] = mat_inv[i][j];
+                }
+            }
+        }
+
+        transform inverse() const { return transform(m_inv, m); }
+
+        point3 apply_point(const point3& p) const {
+            return point3(
+                m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]
+            );
+        }
+
+        vec3 apply_vector(const vec3& v) const {
+            return vec3(
+                m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z
+            );
+        }
+
+        // normals transform by the inverse transpose, the result is not normalized
+        vec3 apply_normal(const vec3& n) const {
+            return vec3(
+                m_inv[0][0] * n.x + m_inv[1][0] * n.y + m_inv[2][0] * n.z,
+                m_inv[0][1] * n.x + m_inv[1][1] * n.y + m_inv[2][1] * n.z,
+                m_inv[0][2] * n.x + m_inv[1][2] * n.y + m_inv[2][2] * n.z
+            );
+        }
+
+        // ray with the same parameterization, direction is not normalized so t is unchanged
+        ray apply_ray(const ray& r) const {
+            return ray(apply_point(r.orig), apply_vector(r.dir), r.time);
+        }
+
+        // box around all eight transformed corners
+        aabb apply_box(const aabb& b) const {
+            aabb res = aabb::empty();
+            for (int i = 0; i < 8; i++) {
+                point3 corner(
+                    (i & 1) ? b.max.x : b.min.x,
+                    (i & 2) ? b.max.y : b.min.y,
+                    (i & 4) ? b.max.z : b.min.z
+                );
+                res = surrounding_box(res, apply_point(corner));
+            }
+            return res;
+        }
+};
+
+// a * b applies b first, then a
+transform operator*(const transform& a, const transform& b) {
+    Float m[4][4], m_inv[4][4];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            m[i][j] = 0;
+            m_inv[i][j] = 0;
+            for (int k = 0; k < 4; k++) {
+                m[i][j] += a.m[i][k] * b.m[k][j];
+                m_inv[i][j] += b.m_inv[i][k] * a.m_inv[k][j];
+            }
+        }
+    }
+    return transform(m, m_inv);
+}
+
+transform translate(const vec3& d) {
+    transform t;
+    t.m[0][3] = d.x;
+    t.m[1][3] = d.y;
+    t.m[2][3] = d.z;
+    t.m_inv[0][3] = -d.x;
+    t.m_inv[1][3] = -d.y;
+    t.m_inv[2][3] = -d.z;
+    return t;
+}
+
+transform scale(const vec3& s) {
+    transform t;
+    t.m[0][0] = s.x;
+    t.m[1][1] = s.y;
+    t.m[2][2] = s.z;
+    t.m_inv[0][0] = 1 / s.x;
+    t.m_inv[1][1] = 1 / s.y;
+    t.m_inv[2][2] = 1 / s.z;
+    return t;
+}
+
+transform scale(Float s) {
+    return scale(vec3(s));
+}
+
+// rotation by theta degrees around axis, the inverse of a rotation is its transpose
+transform rotate(Float theta, const vec3& axis) {
+    vec3 a = unit_vector(axis);
+    Float sin_theta = std::sin(degrees_to_radians(theta));
+    Float cos_theta = std::cos(degrees_to_radians(theta));
+
+    transform t;
+    t.m[0][0] = a.x * a.x + (1 - a.x * a.x) * cos_theta;
+    t.m[0][1] = a.x * a.y * (1 - cos_theta) - a.z * sin_theta;
+    t.m[0][2] = a.x * a.z * (1 - cos_theta) + a.y * sin_theta;
+
+    t.m[1][0] = a.x * a.y * (1 - cos_theta) + a.z * sin_theta;
+    t.m[1][1] = a.y * a.y + (1 - a.y * a.y) * cos_theta;
+    t.m[1][2] = a.y * a.z * (1 - cos_theta) - a.x * sin_theta;
+
+    t.m[2][0] = a.x * a.z * (1 - cos_theta) - a.y * sin_theta;
+    t.m[2][1] = a.y * a.z * (1 - cos_theta) + a.x * sin_theta;
+    t.m[2][2] = a.z * a.z + (1 - a.z * a.z) * cos_theta;
+
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            t.m_inv[i][j] = t.m[j][i];
+
+    return t;
+}
+
+#endif //TRANSFORM_H
@@ -81,6 +81,18 @@ inline Float random_Float() {
     return random_Float(0.0, 1.0);
 }
 
+// nearest float that is not above v, used to store bounds conservatively in float
+inline float round_down_to_float(Float v) {
+    float f = static_cast<float>(v);
+    return static_cast<Float>(f) > v ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+// nearest float that is not below v
+inline float round_up_to_float(Float v) {
+    float f = static_cast<float>(v);
+    return static_cast<Float>(f) < v ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
 inline Float clamp(Float x, Float min, Float max) {
     if (x < min) return min;
     if (x > max) return max;
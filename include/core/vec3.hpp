@@ -47,6 +47,15 @@ class vec3 {
             return !(*this == v);
         }
 
+        //component access by axis index, 0 -> x, 1 -> y, 2 -> z
+        Float operator[](int i) const {
+            return i == 0 ? this->x : (i == 1 ? this->y : this->z);
+        }
+
+        Float& operator[](int i) {
+            return i == 0 ? this->x : (i == 1 ? this->y : this->z);
+        }
+
         //vector negation
         vec3 operator-() const {
             return vec3(-this->x, -this->y, -this->z);
@@ -0,0 +1,151 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "color.hpp"
+#include "film.hpp"
+#include "stats.hpp"
+
+/*
+ * Paths in flight as structure of arrays: the ray, the throughput the light
+ * found further along is scaled by, the radiance gathered so far and the pixel
+ * the path's sample goes to.
+ */
+struct path_batch {
+    std::vector<point3> orig;
+    std::vector<vec3> dir;
+    std::vector<Float> time;
+    std::vector<color> throughput;
+    std::vector<color> radiance;
+    std::vector<int> pixel;
+
+    int size() const { return static_cast<int>(pixel.size()); }
+
+    ray path_ray(int i) const { return ray(orig[i], dir[i], time[i]); }
+
+    void push(int pixel, const ray& r, const color& throughput, const color& radiance) {
+        orig.push_back(r.orig);
+        dir.push_back(r.dir);
+        time.push_back(r.time);
+        this->throughput.push_back(throughput);
+        this->radiance.push_back(radiance);
+        this->pixel.push_back(pixel);
+    }
+
+    void clear() {
+        orig.clear();
+        dir.clear();
+        time.clear();
+        throughput.clear();
+        radiance.clear();
+        pixel.clear();
+    }
+};
+
+/*
+ * Wavefront integrator, the iterative form of ray_color for a batch of paths.
+ * Every bounce runs as separate stages, each a tight loop over one kind of work:
+ *   intersect: closest hit of every path
+ *   miss:      paths that left the scene add the background and end
+ *   sort:      hits are ordered by material
+ *   shade:     emission is added and every material scatters its run of hits,
+ *              paths that scatter are compacted into the next batch
+ * Traversal stays in cache over the whole batch and the virtual material calls
+ * of one run go to the same function. Paths are generated by the caller into paths,
+ * trace adds one sample per path to image. The result matches ray_color,
+ * only the order the random numbers are drawn in differs.
+ */
+class wavefront {
+    public:
+        path_batch paths;
+
+        void trace(const hittable& world, int max_depth, film& image, sampler& rng);
+
+    private:
+        path_batch next;
+        std::vector<hit_record> recs;
+        std::vector<uint8_t> hit;
+
+        // materials of the batch numbered in the order they are first hit, hits are grouped
+        // by these ids instead of by pointer, so the order is the same from run to run
+        std::unordered_map<const material*, int> material_ids;
+        std::vector<const material*> materials;
+        std::vector<std::pair<int, int>> shade_order;
+
+        void intersect(const hittable& world);
+        void miss_and_sort(film& image);
+        void shade(film& image, sampler& rng);
+};
+
+void wavefront::trace(const hittable& world, int max_depth, film& image, sampler& rng) {
+    for (int depth = max_depth; depth > 0 && paths.size() > 0; depth--) {
+        intersect(world);
+        miss_and_sort(image);
+        shade(image, rng);
+        std::swap(paths, next);
+    }
+
+    // paths still going after max_depth bounces get no more light, as ray_color at depth 0
+    for (int i = 0; i < paths.size(); i++)
+        image.add_sample(paths.pixel[i], paths.radiance[i]);
+    paths.clear();
+}
+
+void wavefront::intersect(const hittable& world) {
+    const int n = paths.size();
+    recs.resize(n);
+    hit.resize(n);
+
+    thread_ray_stats.rays += n;
+
+    for (int i = 0; i < n; i++)
+        hit[i] = world.hit(paths.path_ray(i), ray_t_min, infinity, recs[i]);
+}
+
+void wavefront::miss_and_sort(film& image) {
+    shade_order.clear();
+    material_ids.clear();
+    materials.clear();
+
+    for (int i = 0; i < paths.size(); i++) {
+        if (hit[i]) {
+            const material* mat = recs[i].mat_ptr.get();
+            auto id = material_ids.try_emplace(mat, static_cast<int>(materials.size()));
+            if (id.second) materials.push_back(mat);
+            shade_order.push_back({ id.first->second, i });
+        } else {
+            image.add_sample(paths.pixel[i], paths.radiance[i] + paths.throughput[i] * background_color(paths.path_ray(i)));
+        }
+    }
+
+    // within a material the paths stay in batch order, which keeps neighbouring pixels together
+    std::sort(shade_order.begin(), shade_order.end());
+}
+
+void wavefront::shade(film& image, sampler& rng) {
+    next.clear();
+
+    for (const auto& s : shade_order) {
+        const material* mat = materials[s.first];
+        int i = s.second;
+
+        ray r = paths.path_ray(i);
+        color radiance = paths.radiance[i] + paths.throughput[i] * mat->emitted();
+
+        ray scattered;
+        color attenuation;
+        if (mat->scatter(r, recs[i], attenuation, scattered, rng))
+            next.push(paths.pixel[i], scattered, paths.throughput[i] * attenuation, radiance);
+        else
+            image.add_sample(paths.pixel[i], radiance);
+    }
+}
+
+#endif //WAVEFRONT_H
@@ -0,0 +1,72 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "utility.hpp"
+#include "hittable.hpp"
+#include "transform.hpp"
+#include "aabb.hpp"
+
+/*
+ * A placed copy of a shared bottom level structure (usually a mesh BVH).
+ * Rays are moved into object space instead of moving the geometry, so any number
+ * of instances share one copy of the triangles and one BVH.
+ * Like moving_sphere, an instance can translate with a constant velocity over time.
+ */
+class instance : public hittable {
+    public:
+        shared_ptr<hittable> object;
+        transform object_to_world;
+        transform world_to_object;
+        vec3 velocity;
+
+        instance(shared_ptr<hittable> object, const transform& object_to_world)
+            : object{ object }, object_to_world{ object_to_world },
+              world_to_object{ object_to_world.inverse() }, velocity{ 0 } {}
+
+        instance(shared_ptr<hittable> object, const transform& object_to_world, vec3 vel)
+            : object{ object }, object_to_world{ object_to_world },
+              world_to_object{ object_to_world.inverse() }, velocity{ vel } {}
+
+        virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
+        virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override;
+
+    private:
+        ray to_object(const ray& r) const;
+};
+
+// the direction is not normalized, so t means the same in both spaces
+ray instance::to_object(const ray& r) const {
+    point3 orig = r.orig - r.ray_time() * velocity;
+    return ray(world_to_object.apply_point(orig), world_to_object.apply_vector(r.dir), r.ray_time());
+}
+
+bool instance::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    if (!object->hit(to_object(r), t_min, t_max, rec))
+        return false;
+
+    // front_face stays valid, dot(dir, normal) does not change sign under the transform
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(object_to_world.apply_normal(rec.normal));
+    return true;
+}
+
+bool instance::occluded(const ray& r, Float t_min, Float t_max) const {
+    return object->occluded(to_object(r), t_min, t_max);
+}
+
+bool instance::bounding_box(Float time0, Float time1, aabb& output_box) const {
+    aabb object_box;
+    if (!object->bounding_box(time0, time1, object_box))
+        return false;
+
+    aabb box = object_to_world.apply_box(object_box);
+    aabb b0(box.min + time0 * velocity, box.max + time0 * velocity);
+    aabb b1(box.min + time1 * velocity, box.max + time1 * velocity);
+    output_box = surrounding_box(b0, b1);
+    return true;
+}
+
+#endif //INSTANCE_H
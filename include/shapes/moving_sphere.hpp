@@ -3,6 +3,7 @@
 
 #include "utility.hpp"
 #include "hittable.hpp"
+#include "stats.hpp"
 
 class moving_sphere : public hittable {
     public:
@@ -21,6 +22,8 @@ class moving_sphere : public hittable {
 
         virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
         point3 center(Float time) const;
 
         virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override {
@@ -35,14 +38,19 @@ class moving_sphere : public hittable {
             output_box = surrounding_box(b0, b1);
             return true;
         }
+
+    private:
+        bool closest_root(const ray& r, const point3& center, Float t_min, Float t_max, Float& root) const;
 };
 
 point3 moving_sphere::center(Float time) const {
     return cen + time * velocity;
 }
 
-bool moving_sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
-    point3 center = this->center(r.ray_time());
+// closest t in [t_min, t_max] where r meets the sphere at the position center
+bool moving_sphere::closest_root(const ray& r, const point3& center, Float t_min, Float t_max, Float& root) const {
+    thread_ray_stats.primitive_tests++;
+
     vec3 oc = r.orig - center;
     Float a = r.dir.norm_squared();
     Float half_b = dot(oc, r.dir);
@@ -54,7 +62,7 @@ bool moving_sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec)
     Float sqrtd = sqrt(discrim);
 
     // find the closest root inside our range
-    Float root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
     if (root < t_min || root > t_max) {
         root = (-half_b + sqrtd) / a;
 
@@ -62,7 +70,14 @@ bool moving_sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec)
             return false;
     }
 
-    //if we reach here, we found a root
+    return true;
+}
+
+bool moving_sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    point3 center = this->center(r.ray_time());
+    Float root;
+    if (!closest_root(r, center, t_min, t_max, root))
+        return false;
 
     rec.t = root;
     rec.p = r.at(rec.t);
@@ -73,4 +88,9 @@ bool moving_sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec)
     return true;
 }
 
+bool moving_sphere::occluded(const ray& r, Float t_min, Float t_max) const {
+    Float root;
+    return closest_root(r, center(r.ray_time()), t_min, t_max, root);
+}
+
 #endif
\ No newline at end of file
@@ -224,9 +224,7 @@ std::vector<shared_ptr<triangle>> build_mesh(const std::string& filename, shared
         log << std::flush;
         //construct the mesh
         auto mesh = make_shared<TriangleMesh>(nTriangles, &(vertexIndices[0]), nVertices, &(vertices[0]), nullptr, mat_ptr);
-        for (int i = 0; i < nTriangles; i++) {
-            res.push_back(make_shared<triangle>(mesh, i));
-        }
+        res = mesh_triangles(mesh);
         log << "\tTriangle mesh construction complete\n";
     }
 
@@ -5,6 +5,7 @@
 
 #include "utility.hpp"
 #include "hittable.hpp"
+#include "stats.hpp"
 
 class sphere : public hittable {
     public:
@@ -19,11 +20,19 @@ class sphere : public hittable {
          virtual bool hit(const ray& r, Float t_min, 
             Float t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
         virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override;
+
+    private:
+        bool closest_root(const ray& r, Float t_min, Float t_max, Float& root) const;
 };
 
-bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
-    vec3 oc = r.orig - this->center;
+// closest t in [t_min, t_max] where r meets the sphere
+bool sphere::closest_root(const ray& r, Float t_min, Float t_max, Float& root) const {
+    thread_ray_stats.primitive_tests++;
+
+    vec3 oc = r.orig - center;
     Float a = r.dir.norm_squared();
     Float half_b = dot(oc, r.dir);
     Float c = oc.norm_squared() - this->radius * this->radius;
@@ -34,7 +43,7 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const
     Float sqrtd = sqrt(discrim);
 
     // find the closest root inside our range
-    Float root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
     if (root < t_min || root > t_max) {
         root = (-half_b + sqrtd) / a;
 
@@ -42,7 +51,13 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const
             return false;
     }
 
-    //if we reach here, we found a root
+    return true;
+}
+
+bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    Float root;
+    if (!closest_root(r, t_min, t_max, root))
+        return false;
 
     rec.t = root;
     rec.p = r.at(rec.t);
@@ -53,6 +68,11 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const
     return true;
 }
 
+bool sphere::occluded(const ray& r, Float t_min, Float t_max) const {
+    Float root;
+    return closest_root(r, t_min, t_max, root);
+}
+
 bool sphere::bounding_box(Float time0, Float time1, aabb& output_box) const {
     output_box = aabb(
         center - vec3(radius),
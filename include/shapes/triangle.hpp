@@ -3,6 +3,7 @@
 
 #include "utility.hpp"
 #include "hittable.hpp"
+#include "stats.hpp"
 #include "aabb.hpp"
 #include "material.hpp"
 
@@ -61,9 +62,27 @@ class triangle : public hittable {
 
         virtual bool hit(const ray& r, Float time0, Float time1, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, Float t_min, Float t_max) const override;
+
         virtual bool bounding_box(Float time0, Float time1, aabb& output_box) const override;
+
+        // fill rec for a hit at distance t with barycentric coordinates baryU, baryV
+        void fill_hit_record(const ray& r, Float t, Float baryU, Float baryV, hit_record& rec) const;
+
+    private:
+        bool intersect(const ray& r, Float t_min, Float t_max, Float& t, Float& baryU, Float& baryV) const;
 };
 
+// one triangle for every face of mesh
+std::vector<std::shared_ptr<triangle>> mesh_triangles(const std::shared_ptr<TriangleMesh>& mesh) {
+    std::vector<std::shared_ptr<triangle>> res;
+    res.reserve(mesh->nTriangles);
+    for (int i = 0; i < mesh->nTriangles; i++) {
+        res.push_back(std::make_shared<triangle>(mesh, i));
+    }
+    return res;
+}
+
 bool triangle::bounding_box(Float time0, Float time1, aabb& output_box) const {
     output_box = aabb(mesh->p[v[0]], mesh->p[v[1]]);
     output_box = surrounding_box(output_box, mesh->p[v[2]]);
@@ -73,7 +92,9 @@ bool triangle::bounding_box(Float time0, Float time1, aabb& output_box) const {
 /*
  * Moeller Trumbore algorithm for fast ray triangle intersection
  */
-bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+bool triangle::intersect(const ray& r, Float t_min, Float t_max, Float& t, Float& baryU, Float& baryV) const {
+    thread_ray_stats.primitive_tests++;
+
     point3 &a = mesh->p[v[0]];
     point3 &b = mesh->p[v[1]];
     point3 &c = mesh->p[v[2]];
@@ -91,7 +112,7 @@ bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) cons
     vec3 tvec = r.orig - a;
     Float inv_det = 1 / det;
     
-    Float baryU = dot(pvec, tvec) * inv_det;
+    baryU = dot(pvec, tvec) * inv_det;
 
     //test to see if baryU is outside of triangle
     if (baryU < 0.0f || baryU > 1.0) {
@@ -99,18 +120,34 @@ bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) cons
     }
 
     vec3 qvec = cross(tvec, e1);
-    Float baryV = dot(qvec, r.dir) * inv_det;
+    baryV = dot(qvec, r.dir) * inv_det;
 
     //test to see if baryV is outside of triangle
     if (baryV < 0.0 || baryV + baryU > 1.0) {
         return false;
     }
 
-    Float t = dot(qvec, e2) * inv_det;
+    t = dot(qvec, e2) * inv_det;
+
+    return t >= t_min && t <= t_max;
+}
 
-    if (t < t_min || t > t_max)
+bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) const {
+    Float t, baryU, baryV;
+    if (!intersect(r, t_min, t_max, t, baryU, baryV))
         return false;
 
+    fill_hit_record(r, t, baryU, baryV, rec);
+
+    return true;
+}
+
+bool triangle::occluded(const ray& r, Float t_min, Float t_max) const {
+    Float t, baryU, baryV;
+    return intersect(r, t_min, t_max, t, baryU, baryV);
+}
+
+void triangle::fill_hit_record(const ray& r, Float t, Float baryU, Float baryV, hit_record& rec) const {
     Float baryW = 1 - baryU - baryV;
 
     vec3 n;
@@ -118,15 +155,14 @@ bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec) cons
     if (mesh->n) {
         n = baryU * mesh->n[v[0]] + baryV * mesh->n[v[1]] + baryW * mesh->n[v[2]];
     } else {
-        n = unit_vector(cross(e1, e2));
+        const point3 &a = mesh->p[v[0]];
+        n = unit_vector(cross(mesh->p[v[1]] - a, mesh->p[v[2]] - a));
     }
 
     rec.t = t;
     rec.p = r.at(rec.t);
     rec.set_face_normal(r, n);
     rec.mat_ptr = mesh->mat_ptr;
-
-    return true;
 }
 
 // if (baryU > 0.03 && baryW > 0.03 & baryV > 0.03 && baryU < 0.97 && baryV < 0.97 && baryW < 0.97)
@@ -0,0 +1,219 @@
+#ifndef TRIANGLE_CLUSTER_H
+#define TRIANGLE_CLUSTER_H
+
+#include <cstdint>
+
+#if defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+#include "utility.hpp"
+#include "triangle.hpp"
+#include "stats.hpp"
+
+// ray data converted to float once per traversal for the cluster kernels
+struct cluster_ray {
+    float orig[3];
+    float dir[3];
+
+    cluster_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            orig[a] = static_cast<float>(r.orig[a]);
+            dir[a] = static_cast<float>(r.dir[a]);
+        }
+    }
+};
+
+// closest hit found in a cluster, the triangle fills the hit_record later
+struct cluster_hit {
+    const triangle* tri;
+    float t, u, v;
+};
+
+/*
+ * W triangles baked structure of arrays as first vertex and two edges,
+ * so the vertex index lookups and edge subtractions of triangle::hit
+ * are done once at build time and W triangles are tested together.
+ * Unused lanes hold a degenerate triangle that never passes the determinant test.
+ */
+template<int W>
+struct alignas(32) triangle_cluster {
+    float v0[3][W];
+    float e1[3][W];
+    float e2[3][W];
+    const triangle* tris[W];
+    int n_triangles;
+
+    triangle_cluster(const triangle* const* src, int n) : n_triangles{ n } {
+        for (int i = 0; i < W; i++) {
+            point3 a(0), b(0), c(0);
+            tris[i] = i < n ? src[i] : nullptr;
+            if (i < n) {
+                a = src[i]->mesh->p[src[i]->v[0]];
+                b = src[i]->mesh->p[src[i]->v[1]];
+                c = src[i]->mesh->p[src[i]->v[2]];
+            }
+            for (int k = 0; k < 3; k++) {
+                v0[k][i] = static_cast<float>(a[k]);
+                e1[k][i] = static_cast<float>(b[k] - a[k]);
+                e2[k][i] = static_cast<float>(c[k] - a[k]);
+            }
+        }
+    }
+
+    // Moeller Trumbore on every lane, returns true and the closest hit in (t_min, t_max)
+    bool intersect(const cluster_ray& r, float t_min, float t_max, cluster_hit& hit) const;
+};
+
+template<int W>
+inline bool triangle_cluster<W>::intersect(const cluster_ray& r, float t_min, float t_max, cluster_hit& hit) const {
+    thread_ray_stats.primitive_tests += n_triangles;
+
+    bool found = false;
+    for (int i = 0; i < n_triangles; i++) {
+        float px = r.dir[1] * e2[2][i] - r.dir[2] * e2[1][i];
+        float py = r.dir[2] * e2[0][i] - r.dir[0] * e2[2][i];
+        float pz = r.dir[0] * e2[1][i] - r.dir[1] * e2[0][i];
+        float det = px * e1[0][i] + py * e1[1][i] + pz * e1[2][i];
+        if (det < 1e-5f && det > -1e-5f) continue;
+
+        float inv_det = 1 / det;
+        float tx = r.orig[0] - v0[0][i], ty = r.orig[1] - v0[1][i], tz = r.orig[2] - v0[2][i];
+        float u = (px * tx + py * ty + pz * tz) * inv_det;
+        if (u < 0 || u > 1) continue;
+
+        float qx = ty * e1[2][i] - tz * e1[1][i];
+        float qy = tz * e1[0][i] - tx * e1[2][i];
+        float qz = tx * e1[1][i] - ty * e1[0][i];
+        float v = (qx * r.dir[0] + qy * r.dir[1] + qz * r.dir[2]) * inv_det;
+        if (v < 0 || u + v > 1) continue;
+
+        float t = (qx * e2[0][i] + qy * e2[1][i] + qz * e2[2][i]) * inv_det;
+        if (t < t_min || t > t_max) continue;
+
+        t_max = t;
+        hit = { tris[i], t, u, v };
+        found = true;
+    }
+    return found;
+}
+
+#if defined(__SSE2__)
+template<>
+inline bool triangle_cluster<4>::intersect(const cluster_ray& r, float t_min, float t_max, cluster_hit& hit) const {
+    thread_ray_stats.primitive_tests += n_triangles;
+
+    const __m128 dx = _mm_set1_ps(r.dir[0]), dy = _mm_set1_ps(r.dir[1]), dz = _mm_set1_ps(r.dir[2]);
+    const __m128 e1x = _mm_load_ps(e1[0]), e1y = _mm_load_ps(e1[1]), e1z = _mm_load_ps(e1[2]);
+    const __m128 e2x = _mm_load_ps(e2[0]), e2y = _mm_load_ps(e2[1]), e2z = _mm_load_ps(e2[2]);
+
+    // pvec = dir x e2, det = pvec . e1
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, e1x), _mm_mul_ps(py, e1y)), _mm_mul_ps(pz, e1z));
+
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 valid = _mm_cmpge_ps(_mm_and_ps(det, abs_mask), _mm_set1_ps(1e-5f));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // tvec = orig - v0, u = tvec . pvec
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(r.orig[0]), _mm_load_ps(v0[0]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(r.orig[1]), _mm_load_ps(v0[1]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(r.orig[2]), _mm_load_ps(v0[2]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, tx), _mm_mul_ps(py, ty)), _mm_mul_ps(pz, tz)), inv_det);
+
+    // qvec = tvec x e1, v = qvec . dir, t = qvec . e2
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, dx), _mm_mul_ps(qy, dy)), _mm_mul_ps(qz, dz)), inv_det);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, e2x), _mm_mul_ps(qy, e2y)), _mm_mul_ps(qz, e2z)), inv_det);
+
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(u, one));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_set1_ps(t_min)));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(t, _mm_set1_ps(t_max)));
+
+    int mask = _mm_movemask_ps(valid);
+    if (!mask) return false;
+
+    alignas(16) float ts[4], us[4], vs[4];
+    _mm_store_ps(ts, t);
+    _mm_store_ps(us, u);
+    _mm_store_ps(vs, v);
+
+    int best = __builtin_ctz(mask);
+    for (int m = mask & (mask - 1); m; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        if (ts[i] < ts[best]) best = i;
+    }
+
+    hit = { tris[best], ts[best], us[best], vs[best] };
+    return true;
+}
+#endif
+
+#if defined(__AVX__)
+template<>
+inline bool triangle_cluster<8>::intersect(const cluster_ray& r, float t_min, float t_max, cluster_hit& hit) const {
+    thread_ray_stats.primitive_tests += n_triangles;
+
+    const __m256 dx = _mm256_set1_ps(r.dir[0]), dy = _mm256_set1_ps(r.dir[1]), dz = _mm256_set1_ps(r.dir[2]);
+    const __m256 e1x = _mm256_load_ps(e1[0]), e1y = _mm256_load_ps(e1[1]), e1z = _mm256_load_ps(e1[2]);
+    const __m256 e2x = _mm256_load_ps(e2[0]), e2y = _mm256_load_ps(e2[1]), e2z = _mm256_load_ps(e2[2]);
+
+    // pvec = dir x e2, det = pvec . e1
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, e1x), _mm256_mul_ps(py, e1y)), _mm256_mul_ps(pz, e1z));
+
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 valid = _mm256_cmp_ps(_mm256_and_ps(det, abs_mask), _mm256_set1_ps(1e-5f), _CMP_GE_OQ);
+    __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+    // tvec = orig - v0, u = tvec . pvec
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(r.orig[0]), _mm256_load_ps(v0[0]));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(r.orig[1]), _mm256_load_ps(v0[1]));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(r.orig[2]), _mm256_load_ps(v0[2]));
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, tx), _mm256_mul_ps(py, ty)), _mm256_mul_ps(pz, tz)), inv_det);
+
+    // qvec = tvec x e1, v = qvec . dir, t = qvec . e2
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, dx), _mm256_mul_ps(qy, dy)), _mm256_mul_ps(qz, dz)), inv_det);
+    __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, e2x), _mm256_mul_ps(qy, e2y)), _mm256_mul_ps(qz, e2z)), inv_det);
+
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LE_OQ));
+
+    int mask = _mm256_movemask_ps(valid);
+    if (!mask) return false;
+
+    alignas(32) float ts[8], us[8], vs[8];
+    _mm256_store_ps(ts, t);
+    _mm256_store_ps(us, u);
+    _mm256_store_ps(vs, v);
+
+    int best = __builtin_ctz(mask);
+    for (int m = mask & (mask - 1); m; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        if (ts[i] < ts[best]) best = i;
+    }
+
+    hit = { tris[best], ts[best], us[best], vs[best] };
+    return true;
+}
+#endif
+
+#endif //TRIANGLE_CLUSTER_H
@@ -5,6 +5,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <thread>
 
 #include "color.hpp"
@@ -12,6 +13,16 @@
 #include "timing.hpp"
 #include "threading.hpp"
 #include "bvh_node.hpp"
+#include "accelerator.hpp"
+#include "bvh_refit.hpp"
+#include "bvh_cache.hpp"
+#include "bvh_report.hpp"
+#include "heatmap.hpp"
+#include "stats.hpp"
+#include "options.hpp"
+#include "distributed.hpp"
+#include "checkpoint.hpp"
+#include "sampler.hpp"
 
 #include "sample_scenes.hpp"
 
@@ -20,19 +31,25 @@ using std::cin;
 using std::cerr;
 using std::endl;
 
-int main() {
+int main(int argc, char** argv) {
 
-    std::string filename("/Users/Lars/git/cpp_raytracer/models/geodesic/geodesic_classI_2.obj");
-    //std::string filename("/Users/Lars/git/cpp_raytracer/models/bunny.obj");
-    std::string logfile("log.log");
+    render_options opts;
+    //opts.obj_file = "/Users/Lars/git/cpp_raytracer/models/bunny.obj";
+    if (!parse_options(argc, argv, opts, cerr))
+        return 1;
 
-    std::ofstream log(logfile);
+    const std::string& filename = opts.obj_file;
+
+    std::ofstream log(opts.log_file);
     
     if (sizeof(Float) == 4) {
         log << "Type Float is using type: float\n\n";
     } else {
         log << "Type Float is using type: double\n\n";
     }
+
+    if (opts.sampler_bench)
+        sampler_benchmark(log);
     
     // Image properties
     const Float aspect_ratio = 16.0 / 9.0;
@@ -40,7 +57,6 @@ int main() {
     const int image_height = static_cast<int>(image_width / aspect_ratio);
 
     const int MSAA_samples_per_pixel = 4;
-    const int MC_samples_per_pixel = 16;
 
     const int MSAA_subpixel_width = static_cast<int>(sqrt(MSAA_samples_per_pixel));
     const int max_depth = 20;
@@ -58,15 +74,133 @@ int main() {
 
     camera cam(lookfrom, lookat, vup, 20.0, aspect_ratio, aperture, dist_to_focus, time0, time1);
 
-    hittable_list objs = test_obj_file(filename, log);
+    hittable_list objs;
+    shared_ptr<bvh_node> bvh;
+    shared_ptr<hittable> accel;
+
+    // the cache holds the mesh and its linear BVH, so it covers the plain obj scene only
+    bool use_cache = !opts.bvh_cache.empty() && opts.scene == scene_type::obj
+        && opts.accel == accel_type::linear && opts.frames == 1;
+    uint64_t cache_key = 0;
+    std::string cache_path;
+
+    if (!opts.bvh_cache.empty() && !use_cache)
+        log << "BVH cache skipped, it only covers --scene=obj with --accel=linear and a single frame\n\n";
+
+    if (use_cache) {
+        log << "[BVH Cache] Looking for a cached BVH\n";
+        Timer cache_timer;
+        cache_timer.start();
+
+        cache_key = bvh_cache_key(filename, "test_obj_file", opts.bvh, time0, time1);
+        cache_path = bvh_cache_path(opts.bvh_cache, cache_key);
+        log << "\tCache file " << cache_path << "\n";
+
+        bvh_cache cache;
+        if (cache_key != 0 && cache.open(cache_path, cache_key)) {
+            objs = test_mesh_scene(mesh_triangles(cache.load_mesh(test_obj_material())));
+            accel = cache.load_linear_bvh(objs.objects);
+        }
+
+        if (accel) {
+            log << "\tLoaded " << cache.header->n_triangles << " triangles and " << cache.header->n_nodes
+                << " mapped nodes in " << cache_timer.elapsedMilli() << " milliseconds\n";
+        } else {
+            log << "\tNo usable cache, building\n";
+        }
+        log << "[/BVH Cache]\n\n" << std::flush;
+    }
+
+    if (!accel) {
+        if (opts.scene == scene_type::instances) {
+            // bottom level: the mesh is parsed and built once, every instance shares it
+            std::vector<shared_ptr<triangle>> mesh = build_mesh(filename, test_obj_material(), log);
+            std::vector<shared_ptr<hittable>> mesh_objs(mesh.begin(), mesh.end());
+
+            log << "[BLAS] Starting bottom level BVH construction\n" << std::flush;
+            auto blas_bvh = build_bvh(mesh_objs, time0, time1, opts.bvh, log);
+            log << "\tTraversal structure: " << accel_type_name(opts.accel) << "\n";
+            shared_ptr<hittable> blas = build_accelerator(blas_bvh, opts.accel, time0, time1, opts.triangle_clusters, log);
+            objs = instance_grid(blas, opts.n_instances, log);
+            log << "[/BLAS] Bottom level BVH construction finished\n\n";
+        } else if (opts.scene == scene_type::moving) {
+            objs = random_moving_scene();
+        } else if (opts.scene == scene_type::caustic) {
+            objs = caustic_demo();
+        } else {
+            objs = test_obj_file(filename, log);
+        }
+
+        log << "[BVH] Starting BVH construction\n";
+        log << "\tSplit method: " << split_method_name(opts.bvh.split_method);
+        if (opts.bvh.split_method != bvh_split_method::median)
+            log << ", max leaf size " << opts.bvh.max_leaf_size;
+        log << "\n" << std::flush;
 
-    log << "[BVH] Starting BVH construction\n" << std::flush;
+        bvh = build_bvh(objs.objects, time0, time1, opts.bvh, log);
 
-    auto bvh = make_shared<bvh_node>(objs, time0, time1);
+        if (opts.bvh_report)
+            log_bvh_quality(analyze_bvh(*bvh, opts.bvh), log);
 
-    log << "[/BVH] BVH construction finished\n\n";
+        log << "\tTraversal structure: " << accel_type_name(opts.accel) << "\n";
+        if (opts.accel == accel_type::motion)
+            accel = build_motion_bvh(objs.objects, bvh, time0, time1, opts.bvh, opts.time_segments, log);
+        else
+            accel = build_accelerator(bvh, opts.accel, time0, time1, opts.triangle_clusters, log);
 
-    const hittable_list world(bvh);
+        if (opts.bvh_report && opts.bvh.split_method == bvh_split_method::sbvh) {
+            // the same structure over a tree without spatial splits
+            log << "\tBuilding a plain SAH tree to compare against\n";
+            std::ofstream quiet;
+            bvh_build_params plain = opts.bvh;
+            plain.split_method = bvh_split_method::sah;
+            auto plain_bvh = build_bvh(objs.objects, time0, time1, plain, quiet);
+            auto plain_accel = build_accelerator(plain_bvh, opts.accel, time0, time1, opts.triangle_clusters, quiet);
+
+            const int probe_grid = 128;
+            log_traversal_comparison("sah", probe_traversal(*plain_accel, cam, probe_grid),
+                "sbvh", probe_traversal(*accel, cam, probe_grid), log);
+        }
+
+        if (cache_key != 0) {
+            auto mesh = first_mesh(objs);
+            if (mesh && write_bvh_cache(cache_path, cache_key, *mesh, static_cast<const linear_bvh&>(*accel), objs.objects))
+                log << "\tWrote BVH cache " << cache_path << "\n";
+            else
+                log << "\tError: could not write BVH cache " << cache_path << "\n";
+        }
+
+        log << "[/BVH] BVH construction finished\n\n";
+    }
+
+    if (opts.frames > 1) {
+        log << "[Animation] Animating " << opts.frames - 1 << " frames before rendering\n";
+
+        shared_ptr<TriangleMesh> mesh = first_mesh(objs);
+
+        if (mesh) {
+            std::vector<point3> rest(mesh->p.get(), mesh->p.get() + mesh->nVertices);
+            bvh_refitter refitter(objs.objects, bvh, accel, opts.accel, time0, time1,
+                opts.bvh, opts.triangle_clusters, opts.rebuild_threshold);
+
+            Timer anim;
+            anim.start();
+            for (int frame = 1; frame < opts.frames; frame++) {
+                log << "\tFrame " << frame << "\n";
+                twist_mesh(*mesh, rest, frame);
+                accel = refitter.update(log);
+            }
+
+            log << "\t" << refitter.n_refits << " refits and " << refitter.n_rebuilds << " rebuilds took "
+                << anim.elapsedMilli() << " milliseconds\n";
+        } else {
+            log << "\tError: no triangle mesh in the scene, nothing to animate\n";
+        }
+
+        log << "[/Animation] Animation finished\n\n";
+    }
+
+    const hittable_list world(accel);
     //const hittable_list world = objs;
 
     log << "[Render] Render starting\n";
@@ -76,54 +210,389 @@ int main() {
 
     // Render
 
+    film image(image_width, image_height);
+
+    ray_stats* pixel_stats = nullptr;
+    if (!opts.heatmap.empty())
+        pixel_stats = new ray_stats[image_width * image_height];
+
+    render_settings rs = {
+        image_width, image_height, MSAA_samples_per_pixel, MSAA_subpixel_width, MSAA_subpixel_size, max_depth
+    };
+
+    rs.packet_size = opts.packet_size;
+    rs.wavefront_size = opts.wavefront_size;
+    if ((rs.packet_size > 0 || rs.wavefront_size > 0) && pixel_stats) {
+        log << "\tPackets and wavefront off, heatmaps need the traversal counts of every pixel\n";
+        rs.packet_size = 0;
+        rs.wavefront_size = 0;
+    }
+    if (rs.wavefront_size > 0) {
+        log << "\tWavefront integrator, paths traced in batches of " << rs.wavefront_size << "\n";
+        if (rs.packet_size > 0) {
+            log << "\t\tPackets off, the wavefront integrator traces single rays\n";
+            rs.packet_size = 0;
+        }
+    }
+    if (rs.packet_size > 0) {
+        log << "\tTracing camera rays in packets of " << rs.packet_size << "\n";
+        if (opts.accel != accel_type::linear)
+            log << "\t\t" << accel_type_name(opts.accel) << " has no packet traversal, lanes are traced one by one\n";
+    }
+
+    const int num_of_threads = resolve_thread_count(opts.render_threads);
+    log << "\tStarting " << num_of_threads << " threads\n" << std::flush;
+    cerr << num_of_threads << " Threads started, awaiting completion" << endl;
+
+    if (!opts.worker.empty()) {
+        log << "\t[Worker] Rendering tiles for the coordinator at " << opts.worker << "\n" << std::flush;
+        bool ok = run_worker(opts.worker, world, cam, rs, opts.samples, num_of_threads, log);
+        log << "\t[/Worker]\n";
+        log << "[/Render] Rendering complete";
+        delete[] pixel_stats;
+        return ok ? 0 : 1;
+    }
+
+    // a coordinator renders every tile in one go on its workers, there are no passes
+    const bool distributed = opts.coordinator_port >= 0;
+
+    // adaptive sampling spends the same samples in total, but only on pixels above the error threshold
+    const bool adaptive = !distributed && opts.adaptive_error > 0;
+    const int max_samples = opts.max_samples > 0 ? opts.max_samples : 4 * opts.samples;
+    const int min_samples = std::min(opts.min_samples, opts.samples);
+    const long long sample_budget = static_cast<long long>(image_width) * image_height * opts.samples;
+
+    // without a budget to stop early, every sample is rendered in one pass
+    int pass_samples = opts.pass_samples;
+    bool progressive = !distributed && (adaptive || opts.time_budget > 0 || opts.noise_target > 0
+        || !opts.preview.empty() || !opts.checkpoint.empty());
+    if (pass_samples == 0)
+        pass_samples = progressive ? MSAA_samples_per_pixel : opts.samples;
+
     log << "\t[Image Blocks]Building image blocks\n" << std::flush;
-    color *pixels = new color[image_width * image_height];
-    const int pixel_block_size = 30;
-    std::queue<int *> q = buildPixelBlocks(image_width, image_height, pixel_block_size, pixel_block_size);
-    log << "\t\tImage divided into " << pixel_block_size << "x" << pixel_block_size << " blocks\n";
+    int tile_size = opts.tile_size;
+    if (tile_size == 0) {
+        Float sample_micro = pilot_sample_cost(world, cam, rs);
+        // local workers run as many threads as this process, remote ones are not known yet
+        int tile_threads = distributed ? num_of_threads * std::max(opts.local_workers, 1) : num_of_threads;
+        tile_size = choose_tile_size(image_width, image_height, tile_threads, pass_samples, sample_micro);
+        log << "\t\tPilot: " << sample_micro << " microseconds per sample, " << tile_size
+            << " pixel tiles for " << tile_threads << " threads and " << pass_samples << " samples per pass\n";
+    }
+    tile_scheduler tiles(buildPixelBlocks(image_width, image_height, tile_size, opts.tiling));
+    log << "\t\tImage divided into " << tiles.size() << " blocks of " << tile_size << "x" << tile_size
+        << " pixels in " << tile_order_name(opts.tiling) << " order\n";
     log << "\t[/Image Blocks]Finishd building image blocks\n";
 
-    const int num_of_threads = 4;
-    std::future<void> thread_futures [num_of_threads];
-    log << "\tStarting " << num_of_threads << " threads\n" << std::flush;
-    for(int i = 0; i < num_of_threads; i++) {
-        thread_futures[i] = std::async(std::launch::async, thread_render, 
-            std::ref(q), std::ref(pixels), image_width, image_height, std::ref(world),
-            std::ref(cam),MSAA_samples_per_pixel,MC_samples_per_pixel,
-            MSAA_subpixel_width, MSAA_subpixel_size, max_depth);
+    // NUMA placement: pinned threads adding to node local sample buffers and, to replicate,
+    // a traversal structure per node built by a thread on that node from the shared tree
+    numa_topology topology = read_numa_topology();
+    std::vector<shared_ptr<hittable>> replicas;
+    const bool can_replicate = bvh && opts.accel != accel_type::motion && opts.frames == 1;
+
+    auto replicate_world = [&](render_placement& p) {
+        for (int node = 0; node < static_cast<int>(p.worlds.size()); node++) {
+            auto replica = run_on_node(topology, node, [&]() -> shared_ptr<hittable> {
+                std::ofstream quiet;
+                return make_shared<hittable_list>(build_accelerator(bvh, opts.accel, time0, time1, opts.triangle_clusters, quiet));
+            });
+            replicas.push_back(replica);
+            p.worlds[node] = replica.get();
+        }
+    };
+
+    std::unique_ptr<render_placement> placement;
+    const bool numa_section = (opts.numa != numa_mode::off || opts.numa_bench) && !distributed;
+    if (numa_section) {
+        log << "\t[NUMA] " << topology.nodes() << " nodes\n";
+        for (int node = 0; node < topology.nodes(); node++)
+            log << "\t\tNode " << node << ": " << topology.node_cpus[node].size() << " cpus\n";
+        if (opts.numa == numa_mode::replicate && !can_replicate)
+            log << "\t\tNo replicas, they are built from the BVH tree, which cached, animated and motion BVHs do not keep\n";
     }
-    
-    cerr << num_of_threads << " Threads started, awaiting completion" << endl;
-    
-    while(q.size() > 0) {
-        cerr << "\rPixel blocks remaining: " << q.size() << "    " << std::flush;
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    if (opts.numa_bench && !distributed) {
+        log << "\t\t[Benchmark] Rendering " << pass_samples << " samples per pixel on 1 to " << topology.nodes()
+            << " nodes, " << (opts.numa == numa_mode::replicate && can_replicate ? "with" : "without") << " replicas\n" << std::flush;
+        ray_stats saved = total_ray_stats;
+        std::ostream quiet(nullptr);
+        Float one_node = 0;
+
+        for (int n = 1; n <= topology.nodes(); n++) {
+            render_placement bench = place_render_threads(topology, topology.cpus(n), n, world, image_width, image_height);
+            if (opts.numa == numa_mode::replicate && can_replicate) replicate_world(bench);
+
+            film scratch(image_width, image_height);
+            total_ray_stats = ray_stats();
+            Timer bench_timer;
+            bench_timer.start();
+            render_pass(tiles, scratch, world, cam, rs, pass_samples, nullptr, nullptr, 0, quiet, &bench);
+            Float mrays = static_cast<Float>(total_ray_stats.rays) / bench_timer.elapsedMicro();
+
+            if (n == 1) one_node = mrays;
+            log << "\t\t\t" << n << " nodes, " << bench.threads() << " threads: " << mrays << " Mrays/s, "
+                << mrays / one_node << "x one node\n" << std::flush;
+        }
+        if (topology.nodes() == 1)
+            log << "\t\t\tOnly one node, there is nothing to scale to\n";
+
+        total_ray_stats = saved;
+        replicas.clear();
+        log << "\t\t[/Benchmark]\n";
+
+        // the render time and budgets count from here
+        t.start();
     }
 
-    cerr << "\rPixel blocks remaining: " << 0 << "    " << std::flush;
-    
-    //make sure all threads are done
-    for(auto& f : thread_futures) f.get();
+    if (opts.numa != numa_mode::off && !distributed) {
+        int n_nodes = opts.numa_nodes > 0 ? opts.numa_nodes : topology.nodes();
+        placement = std::make_unique<render_placement>(
+            place_render_threads(topology, num_of_threads, n_nodes, world, image_width, image_height));
+        log << "\t\t" << placement->threads() << " threads pinned over " << placement->buffers.size()
+            << " nodes, each with its own sample buffer\n";
+
+        if (opts.numa == numa_mode::replicate && can_replicate) {
+            Timer replica_timer;
+            replica_timer.start();
+            replicate_world(*placement);
+            log << "\t\tBuilt " << replicas.size() << " " << accel_type_name(opts.accel) << " replicas in "
+                << replica_timer.elapsedMilli() << " milliseconds\n";
+        }
+    }
+    if (numa_section)
+        log << "\t[/NUMA]\n";
+
+    // checkpoints hold the film after a number of passes, a resumed render starts with them
+    const uint64_t ckpt_key = checkpoint_key(opts, rs);
+    int pass = 0;
+    long long resumed_samples = 0;
+
+    if (!opts.resume.empty()) {
+        log << "\t[Checkpoint] Resuming from " << opts.resume << "\n";
+        std::ostringstream ckpt_err;
+        if (!read_checkpoint(opts.resume, ckpt_key, image, pass, ckpt_err)) {
+            log << "\t\tError: " << ckpt_err.str() << "\t[/Checkpoint]\n";
+            cerr << ckpt_err.str();
+            delete[] pixel_stats;
+            return 1;
+        }
+        resumed_samples = image.total_samples();
+        log << "\t\t" << pass << " passes, " << static_cast<Float>(resumed_samples) / (image_width * image_height)
+            << " samples per pixel\n";
+        log << "\t[/Checkpoint]\n";
+    }
+
+    auto save_checkpoint = [&]() {
+        Timer ckpt_timer;
+        ckpt_timer.start();
+        if (write_checkpoint(opts.checkpoint, ckpt_key, image, pass))
+            log << "\t\tCheckpoint after pass " << pass << " written in " << ckpt_timer.elapsedMilli() << " milliseconds\n";
+        else
+            log << "\t\tError: could not write checkpoint " << opts.checkpoint << "\n";
+    };
+
+    // tiles are written out by their own thread as they finish, the final image below
+    // then only repeats what a reader of the stream already has
+    tile_stream_writer stream;
+    if (!opts.stream.empty()) {
+        if (!stream.open(opts.stream, image_width, image_height)) {
+            log << "\tError: could not open tile stream " << opts.stream << "\n";
+            cerr << "Could not open tile stream " << opts.stream << endl;
+            delete[] pixel_stats;
+            return 1;
+        }
+        log << "\tStreaming finished tiles to " << opts.stream << "\n" << std::flush;
+    }
+    tile_stream_writer* stream_ptr = opts.stream.empty() ? nullptr : &stream;
+
+    // render threads count into their own counters after every tile, a reporter thread
+    // reads them every interval, so watching a render never slows it down
+    render_telemetry telemetry(placement ? placement->threads() : num_of_threads);
+    if (!opts.telemetry.empty()) {
+        // the plan is set before the reporter thread starts reading it
+        telemetry.set_plan(sample_budget, resumed_samples, opts.time_budget);
+        telemetry.set_pass(pass);
+
+        std::ostringstream telemetry_err;
+        if (!telemetry.open(opts.telemetry, opts.telemetry_interval, telemetry_err)) {
+            log << "\tError: " << telemetry_err.str();
+            cerr << telemetry_err.str();
+            delete[] pixel_stats;
+            return 1;
+        }
+        log << "\tTelemetry to " << opts.telemetry << " every " << opts.telemetry_interval << " seconds\n" << std::flush;
+    }
+    render_telemetry* telemetry_ptr = opts.telemetry.empty() ? nullptr : &telemetry;
+
+    if (distributed) {
+        log << "\t[Distributed] Rendering " << opts.samples << " samples per pixel on workers\n";
+        if (opts.adaptive_error > 0 || opts.time_budget > 0 || opts.noise_target > 0 || !opts.preview.empty())
+            log << "\t\tAdaptive sampling, budgets and previews are off, every tile gets all samples at once\n";
+
+        // workers get the same options, minus the ones that make this process the coordinator
+        std::vector<std::string> worker_args = { argv[0] };
+        for (int i = 1; i < argc; i++) {
+            std::string arg(argv[i]);
+            if (arg.rfind("--coordinator=", 0) == 0 || arg.rfind("--local-workers=", 0) == 0 || arg.rfind("--log=", 0) == 0)
+                continue;
+            worker_args.push_back(arg);
+        }
+        // local workers share this machine, so unless given they split its hardware threads
+        if (opts.render_threads == 0 && opts.local_workers > 0)
+            worker_args.push_back("--threads=" + std::to_string(std::max(1, num_of_threads / opts.local_workers)));
+
+        std::vector<pixel_tile> tile_list;
+        pixel_tile tile;
+        while (tiles.next(tile)) tile_list.push_back(tile);
+
+        bool ok = run_coordinator(opts.coordinator_port, tile_list, image, opts.samples, opts.local_workers,
+            worker_args, opts.log_file, cerr, log, stream_ptr);
+        log << "\t[/Distributed]\n";
+        if (!ok) {
+            delete[] pixel_stats;
+            return 1;
+        }
+        pass++;
+    } else {
+        log << "\t[Passes] Rendering " << opts.samples << " samples per pixel in passes of " << pass_samples << "\n";
+        if (adaptive) {
+            log << "\t\tAdaptive: " << min_samples << " to " << max_samples << " samples per pixel, error threshold "
+                << opts.adaptive_error << "\n";
+        }
+
+        if (!opts.checkpoint.empty())
+            log << "\t\tCheckpoints to " << opts.checkpoint << " every " << opts.checkpoint_interval << " seconds\n";
+
+        std::vector<uint8_t> active;
+        int samples_done = static_cast<int>(resumed_samples / (image_width * image_height));
+        Timer since_checkpoint;
+        since_checkpoint.start();
+        long long last_pass_micro = 0;
+        long long last_pass_total = 0;
+        const char* stop_reason = "sample budget reached";
+
+        while (true) {
+            int n;
+            const std::vector<uint8_t>* pass_pixels = nullptr;
+            long long pixels_in_pass = static_cast<long long>(image_width) * image_height;
+
+            if (adaptive && pass > 0) {
+                n = pass_samples;
+                long long left = sample_budget - image.total_samples();
+                if (left <= 0) {
+                    // a checkpoint resumed with fewer --samples than it was rendered with
+                    if (left < 0) stop_reason = "the resumed image already has more samples than --samples asks for";
+                    break;
+                }
+                pixels_in_pass = select_noisy_pixels(image, opts.adaptive_error, max_samples, left, n, active);
+                if (pixels_in_pass == 0) {
+                    if (left >= n) stop_reason = "every pixel converged or reached the maximum samples";
+                    break;
+                }
+                pass_pixels = &active;
+            } else {
+                n = adaptive ? min_samples : std::min(pass_samples, opts.samples - samples_done);
+                if (n <= 0) break;
+            }
+
+            // stop before a pass that would likely run past the time budget, the first pass always runs
+            if (opts.time_budget > 0 && pass > 0) {
+                long long predicted = last_pass_micro * (pixels_in_pass * n) / last_pass_total;
+                if (t.elapsedMicro() + predicted > static_cast<long long>(opts.time_budget * 1e6)) {
+                    stop_reason = "time budget reached";
+                    break;
+                }
+            }
+
+            Timer pass_timer;
+            pass_timer.start();
+            render_pass(tiles, image, world, cam, rs, n, pass_pixels, pixel_stats, num_of_threads, cerr, placement.get(),
+                stream_ptr, telemetry_ptr);
+            last_pass_micro = pass_timer.elapsedMicro();
+            last_pass_total = pixels_in_pass * n;
+
+            samples_done += n;
+            pass++;
+            if (telemetry_ptr) telemetry.set_pass(pass);
+
+            Float noise = image.noise();
+            log << "\t\tPass " << pass << ": " << n << " samples to " << pixels_in_pass << " pixels, "
+                << static_cast<Float>(image.total_samples()) / (image_width * image_height)
+                << " samples per pixel after " << t.elapsedMilli() << " milliseconds, noise " << noise << "\n" << std::flush;
+
+            if (!opts.preview.empty()) {
+                std::ofstream preview(opts.preview);
+                image.write(preview);
+            }
+
+            if (!opts.checkpoint.empty() && since_checkpoint.elapsedMilli() >= opts.checkpoint_interval * 1000) {
+                save_checkpoint();
+                since_checkpoint.start();
+            }
+
+            if (opts.noise_target > 0 && noise <= opts.noise_target) {
+                stop_reason = "noise target reached";
+                break;
+            }
+        }
+
+        log << "\t\tStopped after " << pass << " passes, " << stop_reason << "\n";
+        log << "\t[/Passes]\n";
+    }
+
+    if (stream_ptr) {
+        Timer drain;
+        drain.start();
+        stream.close();
+        log << "\tStreamed " << stream.tiles_written << " tiles, " << stream.bytes_written << " bytes, "
+            << drain.elapsedMilli() << " milliseconds to drain after the last pass\n";
+    }
+
+    if (telemetry_ptr) telemetry.close();
+
+    // the last checkpoint holds the finished image, a later run can add samples to it
+    if (!opts.checkpoint.empty())
+        save_checkpoint();
 
     long long timeMicro = t.elapsedMicro();
     long long timeMilli = timeMicro / 1000;
     cerr << "\nDone calculating.\n";
     cerr << "Ray tracing took " << timeMilli <<  " milliseconds" << endl;
     cerr << "Ray tracing averaged " <<
-        static_cast<Float>(static_cast<long>(image_width) * static_cast<long>(image_height) * static_cast<long>(MSAA_samples_per_pixel) * static_cast<long>(MC_samples_per_pixel)) / timeMicro 
+        static_cast<Float>(image.total_samples() - resumed_samples) / timeMicro 
         <<  " pixel calculations per microsecond" << endl;
 
     log << "\tDone calculating\n";
     log << "\tRay tracing took " << timeMilli <<  " milliseconds\n";
     log << "\tRay tracing averaged " <<
-        static_cast<Float>(static_cast<long>(image_width) * static_cast<long>(image_height) * static_cast<long>(MSAA_samples_per_pixel) * static_cast<long>(MC_samples_per_pixel)) / timeMicro 
-        <<  " pixel calculations per microseconds\n" << std::flush;
+        static_cast<Float>(image.total_samples() - resumed_samples) / timeMicro 
+        <<  " pixel calculations per microseconds\n";
+
+    const ray_stats& stats = total_ray_stats;
+    Float rays = static_cast<Float>(stats.rays);
+    cerr << "Traced " << stats.rays << " rays, " << rays / timeMicro << " Mrays/s" << endl;
+    log << "\tTraced " << stats.rays << " rays, " << rays / timeMicro << " Mrays/s\n";
+    // one camera ray per sample, the rest are bounces. Workers trace and count their own rays
+    if (!distributed) {
+        long long primary_rays = image.total_samples() - resumed_samples;
+        log << "\t\t" << primary_rays << " primary, " << stats.rays - primary_rays << " secondary rays\n";
+    }
+    log << "\tNode visits per ray: " << stats.nodes_visited / rays << "\n";
+    log << "\tPrimitive tests per ray: " << stats.primitive_tests / rays << "\n" << std::flush;
     
     log << "\tWriting data to image now\n";
-    write_image(std::cout, pixels, image_width, image_height, MSAA_samples_per_pixel, MC_samples_per_pixel);
-    log << "\tFinished writing data to image\n" << std::flush;
+    Timer write_timer;
+    write_timer.start();
+    image.write(std::cout);
+    log << "\tFinished writing data to image in " << write_timer.elapsedMilli() << " milliseconds\n" << std::flush;
 
-    delete[] pixels;
+    if (!opts.spp_map.empty())
+        write_sample_count_map(opts.spp_map, image, log);
+
+    if (pixel_stats) {
+        write_traversal_heatmaps(opts.heatmap, pixel_stats, image, log);
+        delete[] pixel_stats;
+    }
 
     log << "[/Render] Rendering complete";
     log.close();